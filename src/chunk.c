@@ -10,12 +10,16 @@ void initChunk(Chunk* chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
 }
 
 void freeChunk(Chunk* chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   FREE_ARRAY(int, chunk->lines, chunk->capacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
   initChunk(chunk);
 }
 
@@ -38,3 +42,306 @@ int addConstant(Chunk* chunk, Value value) {
   pop();
   return chunk->constants.count - 1;
 }
+
+int addInlineCache(Chunk* chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+  }
+
+  InlineCache* cache = &chunk->caches[chunk->cacheCount];
+  cache->count = 0;
+  cache->megamorphic = false;
+  cache->epoch = 0;
+  cache->field = NULL;
+  cache->argCount = 0;
+
+# if DEBUG_INLINE_CACHE_STATS
+  cache->line = chunk->lines[chunk->count - 1];
+  cache->name = NULL;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->megamorphicCalls = 0;
+# endif
+
+  return chunk->cacheCount++;
+}
+
+static inline int variableSize(Chunk* chunk, int offset) {
+  return chunk->code[offset] >= 0x80 ? 2 : 1;
+}
+
+// The number of bytes taken up by the instruction at [offset], including its
+// operands.
+int instructionSize(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_NONE:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_PRINT:
+    case OP_ERROR:
+    case OP_CALL_0: case OP_CALL_1: case OP_CALL_2: case OP_CALL_3:
+    case OP_CALL_4: case OP_CALL_5: case OP_CALL_6: case OP_CALL_7:
+    case OP_CALL_8: case OP_CALL_9: case OP_CALL_10: case OP_CALL_11:
+    case OP_CALL_12: case OP_CALL_13: case OP_CALL_14: case OP_CALL_15:
+    case OP_CALL_16:
+    case OP_TAIL_CALL_0: case OP_TAIL_CALL_1: case OP_TAIL_CALL_2: case OP_TAIL_CALL_3:
+    case OP_TAIL_CALL_4: case OP_TAIL_CALL_5: case OP_TAIL_CALL_6: case OP_TAIL_CALL_7:
+    case OP_TAIL_CALL_8: case OP_TAIL_CALL_9: case OP_TAIL_CALL_10: case OP_TAIL_CALL_11:
+    case OP_TAIL_CALL_12: case OP_TAIL_CALL_13: case OP_TAIL_CALL_14: case OP_TAIL_CALL_15:
+    case OP_TAIL_CALL_16:
+    case OP_IMPORT_ALL_VARIABLES:
+    case OP_END_MODULE:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_RETURN_OUTPUT:
+    case OP_POP_LOOP:
+      return 1;
+
+    case OP_DUP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_TUPLE:
+    case OP_GET_LOCAL_GET_LOCAL:
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_SET_LOCAL_POP:
+    case OP_BINARY_LOCAL_LOCAL:
+    case OP_BINARY_LOCAL_CONSTANT:
+      return 2;
+
+    case OP_JUMP:
+    case OP_JUMP_FALSY:
+    case OP_JUMP_TRUTHY:
+    case OP_JUMP_TRUTHY_POP:
+    case OP_LOOP:
+    case OP_JUMP_FALSY_POP:
+      return 3;
+
+    case OP_ITER_NEXT:
+    case OP_RANGE_START:
+      // The slot of the sequence, or whether the range is inclusive for
+      // RANGE_START, then the jumps to the exit check and the body.
+      return 6;
+
+    case OP_RANGE_NEXT:
+      // The same as ITER_NEXT, followed by whether the range is inclusive.
+      return 7;
+
+    case OP_SLICE:
+    case OP_UNPACK:
+      // Whether the range is inclusive, or the number of values to unpack,
+      // then a jump past the code that does it the slow way.
+      return 4;
+
+    case OP_INVOKE_0: case OP_INVOKE_1: case OP_INVOKE_2: case OP_INVOKE_3:
+    case OP_INVOKE_4: case OP_INVOKE_5: case OP_INVOKE_6: case OP_INVOKE_7:
+    case OP_INVOKE_8: case OP_INVOKE_9: case OP_INVOKE_10: case OP_INVOKE_11:
+    case OP_INVOKE_12: case OP_INVOKE_13: case OP_INVOKE_14: case OP_INVOKE_15:
+    case OP_INVOKE_16:
+    case OP_TAIL_INVOKE_0: case OP_TAIL_INVOKE_1: case OP_TAIL_INVOKE_2: case OP_TAIL_INVOKE_3:
+    case OP_TAIL_INVOKE_4: case OP_TAIL_INVOKE_5: case OP_TAIL_INVOKE_6: case OP_TAIL_INVOKE_7:
+    case OP_TAIL_INVOKE_8: case OP_TAIL_INVOKE_9: case OP_TAIL_INVOKE_10: case OP_TAIL_INVOKE_11:
+    case OP_TAIL_INVOKE_12: case OP_TAIL_INVOKE_13: case OP_TAIL_INVOKE_14: case OP_TAIL_INVOKE_15:
+    case OP_TAIL_INVOKE_16:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_LESS_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_GET_SUBSCRIPT:
+    case OP_SET_SUBSCRIPT:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_FIELD:
+    case OP_SET_FIELD:
+    case OP_INVOKE_CACHED: {
+      // The method signature or property name, followed by the inline cache.
+      int size = 1 + variableSize(chunk, offset + 1);
+      return size + variableSize(chunk, offset + size);
+    }
+
+    case OP_CLOSURE: {
+      int size = 1 + variableSize(chunk, offset + 1);
+      int constant = chunk->code[offset + 1];
+      if (constant >= 0x80) constant = ((constant & 0x7f) << 8) | chunk->code[offset + 2];
+
+      ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+      return size + function->upvalueCount * 2;
+    }
+
+    default:
+      // Everything else takes a single constant.
+      return 1 + variableSize(chunk, offset + 1);
+  }
+}
+
+// How many values the instruction at [offset] leaves on the stack, compared to
+// before it ran. Fused instructions don't show up here, because this runs
+// before fuseInstructions().
+static int stackEffect(Chunk* chunk, int offset) {
+  uint8_t instruction = chunk->code[offset];
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_NONE:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_DUP:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_IMPORT_MODULE:
+    case OP_IMPORT_VARIABLE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+      return 1;
+
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_BIND_METHOD:
+    case OP_BIND_SUPER:
+    case OP_JUMP:
+    case OP_JUMP_FALSY:
+    case OP_JUMP_TRUTHY:
+    case OP_LOOP:
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_IMPORT_ALL_VARIABLES:
+    case OP_END_MODULE:
+    case OP_RETURN_OUTPUT:
+    case OP_ERROR:
+    case OP_ITER_NEXT:
+    case OP_RANGE_START:
+    case OP_RANGE_NEXT:
+    case OP_SLICE:
+    case OP_UNPACK:
+      return 0;
+
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_IMMUTABLE_GLOBAL:
+    case OP_SET_PROPERTY:
+    case OP_PRINT:
+    case OP_JUMP_TRUTHY_POP:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_LESS_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_METHOD_INSTANCE:
+    case OP_METHOD_STATIC:
+    case OP_GET_SUBSCRIPT:
+      return -1;
+
+    case OP_SET_SUBSCRIPT:
+      return -2;
+
+    case OP_TUPLE:
+      return 1 - chunk->code[offset + 1];
+
+    default:
+      // The arguments are replaced by the result, along with the superclass
+      // for a super call.
+      if (instruction >= OP_CALL_0 && instruction <= OP_CALL_16) return -(instruction - OP_CALL_0);
+      if (instruction >= OP_INVOKE_0 && instruction <= OP_INVOKE_16) return -(instruction - OP_INVOKE_0);
+      if (instruction >= OP_SUPER_0 && instruction <= OP_SUPER_16) return -(instruction - OP_SUPER_0) - 1;
+
+      ASSERT(false, "Unexpected instruction");
+      return 0;
+  }
+}
+
+// Records that the instruction at [target] starts with [depth] values on the
+// stack, and queues it up if no path has reached it yet.
+static inline void reachInstruction(Chunk* chunk, int* depths, int* pending, int* pendingCount,
+                                    int target, int depth) {
+  if (target < chunk->count && depths[target] == -1) {
+    depths[target] = depth;
+    pending[(*pendingCount)++] = target;
+  }
+}
+
+// Follows every path through the bytecode to find the deepest the stack gets,
+// starting from [initialDepth] values. The compiler always leaves the stack at
+// the same depth wherever paths meet, so each instruction only needs to be
+// looked at once.
+int maxStackDepth(Chunk* chunk, int initialDepth) {
+  if (chunk->count == 0) return initialDepth;
+
+  int* depths = (int*)malloc(sizeof(int) * chunk->count);
+  int* pending = (int*)malloc(sizeof(int) * chunk->count);
+  if (depths == NULL || pending == NULL) exit(1);
+
+  for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+
+  int maxDepth = initialDepth;
+  int pendingCount = 0;
+  reachInstruction(chunk, depths, pending, &pendingCount, 0, initialDepth);
+
+  while (pendingCount > 0) {
+    int offset = pending[--pendingCount];
+    int depth = depths[offset];
+
+    while (true) {
+      uint8_t* code = &chunk->code[offset];
+      depth += stackEffect(chunk, offset);
+      if (depth > maxDepth) maxDepth = depth;
+
+      int next = offset + instructionSize(chunk, offset);
+      if (*code == OP_RETURN || *code == OP_ERROR) break;
+
+      if (*code == OP_JUMP || *code == OP_JUMP_FALSY || *code == OP_JUMP_TRUTHY ||
+          *code == OP_JUMP_TRUTHY_POP || *code == OP_LOOP) {
+        int jump = (code[1] << 8) | code[2];
+        int target = *code == OP_LOOP ? next - jump : next + jump;
+        reachInstruction(chunk, depths, pending, &pendingCount, target, depth);
+        if (*code == OP_JUMP || *code == OP_LOOP) break;
+      } else if (*code == OP_ITER_NEXT || *code == OP_RANGE_START || *code == OP_RANGE_NEXT) {
+        // Both jumps push a value: False for the exit check, or the next item
+        // for the body. RANGE_START pushes the step before that.
+        int pushed = *code == OP_RANGE_START ? 2 : 1;
+        if (depth + pushed > maxDepth) maxDepth = depth + pushed;
+        int test = offset + 4 + ((code[2] << 8) | code[3]);
+        int body = offset + 6 + ((code[4] << 8) | code[5]);
+        reachInstruction(chunk, depths, pending, &pendingCount, test, depth + pushed);
+        reachInstruction(chunk, depths, pending, &pendingCount, body, depth + pushed);
+      } else if (*code == OP_SLICE || *code == OP_UNPACK) {
+        // SLICE replaces the sequence and both ends of the range with the
+        // slice, and UNPACK pushes the values after the tuple.
+        int target = next + ((code[2] << 8) | code[3]);
+        int jumpDepth = *code == OP_SLICE ? depth - 2 : depth + code[1];
+        if (jumpDepth > maxDepth) maxDepth = jumpDepth;
+        reachInstruction(chunk, depths, pending, &pendingCount, target, jumpDepth);
+      }
+
+      if (next >= chunk->count || depths[next] != -1) break;
+      depths[next] = depth;
+      offset = next;
+    }
+  }
+
+  free(depths);
+  free(pending);
+  return maxDepth;
+}
@@ -5,104 +5,61 @@
 #include "value.h"
 
 typedef enum {
-  OP_CONSTANT,
-  OP_NONE,
-  OP_TRUE,
-  OP_FALSE,
-
-  OP_POP,
-  OP_DUP,
-
-  OP_GET_LOCAL,
-  OP_SET_LOCAL,
-  OP_GET_GLOBAL,
-  OP_DEFINE_GLOBAL,
-  OP_DEFINE_IMMUTABLE_GLOBAL,
-  OP_SET_GLOBAL,
-  OP_GET_UPVALUE,
-  OP_SET_UPVALUE,
-  OP_GET_PROPERTY,
-  OP_SET_PROPERTY,
+# define OPCODE(name) OP_##name,
+# include "opcodes.h"
+# undef OPCODE
+} OpCode;
 
-  OP_BIND_METHOD,
-  OP_BIND_SUPER,
+typedef struct ObjClass ObjClass;
+typedef struct ObjString ObjString;
+typedef struct ObjShape ObjShape;
 
-  OP_PRINT,
-  OP_ERROR,
-  OP_JUMP,
-  OP_JUMP_FALSY,
-  OP_JUMP_TRUTHY,
-  OP_JUMP_TRUTHY_POP,
-  OP_LOOP,
+typedef struct {
+  ObjClass* cls;
+  Value method;
 
-  OP_CALL_0,
-  OP_CALL_1,
-  OP_CALL_2,
-  OP_CALL_3,
-  OP_CALL_4,
-  OP_CALL_5,
-  OP_CALL_6,
-  OP_CALL_7,
-  OP_CALL_8,
-  OP_CALL_9,
-  OP_CALL_10,
-  OP_CALL_11,
-  OP_CALL_12,
-  OP_CALL_13,
-  OP_CALL_14,
-  OP_CALL_15,
-  OP_CALL_16,
+  // Property sites also key their entries on the receiver's shape, which is
+  // NULL for anything that isn't an instance. When the property is a field,
+  // [slot] is where it's stored, and for a store that adds the field,
+  // [transition] is the shape the instance ends up with. [slot] is -1 for
+  // attributes, whose getter is in [method].
+  ObjShape* shape;
+  ObjShape* transition;
+  int slot;
+} InlineCacheEntry;
 
-  OP_INVOKE_0,
-  OP_INVOKE_1,
-  OP_INVOKE_2,
-  OP_INVOKE_3,
-  OP_INVOKE_4,
-  OP_INVOKE_5,
-  OP_INVOKE_6,
-  OP_INVOKE_7,
-  OP_INVOKE_8,
-  OP_INVOKE_9,
-  OP_INVOKE_10,
-  OP_INVOKE_11,
-  OP_INVOKE_12,
-  OP_INVOKE_13,
-  OP_INVOKE_14,
-  OP_INVOKE_15,
-  OP_INVOKE_16,
+// Every method call site and property access gets one of these. It remembers
+// what was found for the last few receiver classes, so calling the same kinds
+// of objects over and over again doesn't need to look the method up in the
+// class every time. Once a site has seen more classes than it can hold, it's
+// megamorphic and any other classes are looked up in their own method arrays,
+// indexed by the method name's symbol.
+//
+// The cache is only valid while its epoch matches vm.methodEpoch, which
+// changes whenever a class is created or any method table is modified.
+typedef struct {
+  InlineCacheEntry entries[INLINE_CACHE_ENTRIES];
+  uint8_t count;
+  bool megamorphic;
+  uint32_t epoch;
 
-  OP_SUPER_0,
-  OP_SUPER_1,
-  OP_SUPER_2,
-  OP_SUPER_3,
-  OP_SUPER_4,
-  OP_SUPER_5,
-  OP_SUPER_6,
-  OP_SUPER_7,
-  OP_SUPER_8,
-  OP_SUPER_9,
-  OP_SUPER_10,
-  OP_SUPER_11,
-  OP_SUPER_12,
-  OP_SUPER_13,
-  OP_SUPER_14,
-  OP_SUPER_15,
-  OP_SUPER_16,
+  // For a method call, the name of the method without its arity, which is
+  // the name of a field that would be called instead. NULL if there's no such
+  // field name to check, like for operators and property accesses.
+  ObjString* field;
 
-  OP_IMPORT_MODULE,
-  OP_IMPORT_VARIABLE,
-  OP_IMPORT_ALL_VARIABLES,
-  OP_END_MODULE,
+  // The argument count of an invoke that's been quickened to INVOKE_CACHED,
+  // which doesn't have it in its opcode anymore.
+  uint8_t argCount;
 
-  OP_TUPLE,
-  OP_CLOSURE,
-  OP_CLOSE_UPVALUE,
-  OP_RETURN,
-  OP_RETURN_OUTPUT,
-  OP_CLASS,
-  OP_METHOD_INSTANCE,
-  OP_METHOD_STATIC
-} OpCode;
+# if DEBUG_INLINE_CACHE_STATS
+  int line;
+  ObjString* name;
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t megamorphicCalls;
+# endif
+} InlineCache;
 
 typedef struct {
   int count;
@@ -110,11 +67,18 @@ typedef struct {
   uint8_t* code;
   int* lines;
   ValueArray constants;
+
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
+int instructionSize(Chunk* chunk, int offset);
+int maxStackDepth(Chunk* chunk, int initialDepth);
 
 #endif
@@ -60,6 +60,24 @@
 #  define NAN_TAGGING 1
 #endif
 
+// The VM's run() loop normally dispatches instructions with one big switch
+// statement. That works everywhere, but every instruction goes through the
+// same indirect jump at the top of the switch, which the CPU has a hard time
+// predicting, and the compiler adds a bounds check on the opcode too.
+//
+// GCC and Clang support "labels as values", which lets us build a table of
+// addresses for every instruction and jump straight from the end of one
+// instruction to the start of the next. Each instruction gets its own indirect
+// jump, so the branch predictor has a much better chance. The switch is still
+// used as a fallback for other compilers, or if this is set to 0.
+#ifndef COMPUTED_GOTO
+#  if defined(__GNUC__) || defined(__clang__)
+#    define COMPUTED_GOTO 1
+#  else
+#    define COMPUTED_GOTO 0
+#  endif
+#endif
+
 // CURRENT MAINTENANCE FLAGS
 // These will be removed after I know the new change works.
 
@@ -92,10 +110,37 @@
 // Prevents the VM from initializing the core library. (Why would you do this?)
 #define DEBUG_REMOVE_CORE 0
 
+// Count how often every method call site hits its inline cache, and print the
+// counts when the function is freed.
+// 0 to disable, 1 to print only user code, 2 to print everything.
+#define DEBUG_INLINE_CACHE_STATS 0
+
+// Count how often every pair of instructions runs back to back, and print the
+// most common pairs when the VM is freed.
+#define DEBUG_COUNT_OPCODE_PAIRS 0
+
 // COMPILER AND VM VALUES
 
 #define MAX_CONSTANTS 0x7fff
 
+#define MAX_INLINE_CACHES 0x7fff
+
+#define MAX_MODULE_VARIABLES 0x7fff
+
+// The most memory the value stack and the call frames can take up together.
+// A program that needs more than this gets a stack overflow.
+#ifndef MAX_STACK_BYTES
+#  define MAX_STACK_BYTES (64 * 1024 * 1024)
+#endif
+
+// How many calls it takes before a function is optimized with what the VM
+// knows by then. See optimizeHotFunction() in vm.c.
+#define HOT_FUNCTION_CALLS 1000
+
+// How many receiver classes a call site remembers before it's considered
+// megamorphic and looks methods up in the class every time.
+#define INLINE_CACHE_ENTRIES 4
+
 // It's not a good idea to change this. The value is hardcoded in many places.
 #define MAX_PARAMETERS 16
 
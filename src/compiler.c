@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "core.h"
 #include "lexer.h"
 #include "memory.h"
 #include "utils.h"
@@ -34,6 +35,9 @@ typedef struct {
   // If an expression was parsed most recently.
   bool onExpression;
 
+  // Where the code for the left operand of the current infix operator starts.
+  int operandStart;
+
   // If a compiler error has appeared.
   bool hadError;
   bool panicMode;
@@ -137,6 +141,14 @@ typedef struct Loop {
   struct Loop* enclosing;
 } Loop;
 
+// The chunk as it was before some code that can never run, so the code can be
+// compiled, to report its errors, and then thrown away.
+typedef struct {
+  int count;
+  int constantCount;
+  int cacheCount;
+} DeadCode;
+
 typedef enum {
   TYPE_FUNCTION,
   TYPE_LAMBDA,
@@ -331,6 +343,15 @@ static int emitJump(uint8_t instruction) {
   return currentChunk()->count - 2;
 }
 
+// Emits an instruction with a byte operand, followed by a jump that's patched
+// like the one from emitJump.
+static int emitByteJump(uint8_t instruction, uint8_t byte) {
+  emitBytes(instruction, byte);
+  emitByte(0xff);
+  emitByte(0xff);
+  return currentChunk()->count - 2;
+}
+
 static void emitReturn() {
   if (current->type == TYPE_INITIALIZER) {
     emitBytes(OP_GET_LOCAL, 0);
@@ -361,8 +382,44 @@ static void emitConstantArg(uint8_t instruction, Value arg) {
   emitVariableBytes(makeConstant(arg));
 }
 
+static int makeInlineCache() {
+  int cache = addInlineCache(currentChunk());
+  if (cache > MAX_INLINE_CACHES) {
+    error("A function can only contain %d method calls and property accesses", MAX_INLINE_CACHES);
+    return 0;
+  }
+
+  return cache;
+}
+
+// Method calls and property accesses take the constant holding the method
+// signature or property name, followed by the index of the site's inline cache.
+static int emitCachedArg(uint8_t instruction, int constant) {
+  emitVariableArg(instruction, constant);
+  int cache = makeInlineCache();
+  emitVariableBytes(cache);
+  return cache;
+}
+
+static inline void emitInvokeInstruction(uint8_t instruction, int constant) {
+  int cache = emitCachedArg(instruction, constant);
+
+  // A field with the same name as the method gets called instead, so the VM
+  // needs the name without the arity to check for one. Attributes don't have
+  // an arity, and can't be shadowed this way.
+  ObjString* signature = AS_STRING(currentChunk()->constants.values[constant]);
+  const char* paren = memchr(signature->chars, '(', signature->length);
+  if (paren != NULL) {
+    currentChunk()->caches[cache].field = copyStringLength(signature->chars, (int)(paren - signature->chars));
+  }
+}
+
+static inline void emitInvoke(int argCount, int constant) {
+  emitInvokeInstruction(OP_INVOKE_0 + argCount, constant);
+}
+
 static inline void callMethod(int argCount, const char* name, int length) {
-  emitConstantArg(OP_INVOKE_0 + argCount, OBJ_VAL(copyStringLength(name, length)));
+  emitInvoke(argCount, makeConstant(OBJ_VAL(copyStringLength(name, length))));
 }
 
 static void patchJump(int offset) {
@@ -414,6 +471,27 @@ static void endLoop() {
   current->loop = current->loop->enclosing;
 }
 
+static void startDeadCode(DeadCode* dead) {
+  Chunk* chunk = currentChunk();
+  dead->count = chunk->count;
+  dead->constantCount = chunk->constants.count;
+  dead->cacheCount = chunk->cacheCount;
+}
+
+static void endDeadCode(DeadCode* dead) {
+  Chunk* chunk = currentChunk();
+  chunk->count = dead->count;
+  chunk->constants.count = dead->constantCount;
+  chunk->cacheCount = dead->cacheCount;
+
+  // Any breaks in the code are gone, so they mustn't be patched.
+  for (Loop* loop = current->loop; loop != NULL; loop = loop->enclosing) {
+    while (loop->breakCount > 0 && loop->breaks[loop->breakCount - 1] >= dead->count) {
+      loop->breakCount--;
+    }
+  }
+}
+
 static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->loop = NULL;
@@ -446,6 +524,70 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   }
 }
 
+// Whether the instruction at [offset] reads a local, and the next one reads
+// another local or a constant that are then used by a binary operator.
+static bool isBinaryOnLocal(Chunk* chunk, int offset) {
+  uint8_t* code = chunk->code;
+  if (code[offset] != OP_GET_LOCAL) return false;
+
+  int next = offset + 2;
+  if (next >= chunk->count || (code[next] != OP_GET_LOCAL && code[next] != OP_CONSTANT)) return false;
+
+  int after = next + instructionSize(chunk, next);
+  return after < chunk->count && code[after] >= OP_ADD && code[after] <= OP_NOT_EQUAL;
+}
+
+// Replaces the first instruction of common pairs with a superinstruction that
+// runs both of them. Only that one opcode changes, so nothing in the chunk
+// moves and none of the jumps need to be patched.
+static void fuseInstructions(Chunk* chunk) {
+  uint8_t* code = chunk->code;
+
+  int next;
+  for (int offset = 0; offset < chunk->count; offset = next) {
+    next = offset + instructionSize(chunk, offset);
+    if (next >= chunk->count) break;
+
+    // A call that's immediately returned is in tail position.
+    if (code[next] == OP_RETURN) {
+      if (code[offset] >= OP_CALL_0 && code[offset] <= OP_CALL_16) {
+        code[offset] += OP_TAIL_CALL_0 - OP_CALL_0;
+        continue;
+      }
+
+      if (code[offset] >= OP_INVOKE_0 && code[offset] <= OP_INVOKE_16) {
+        code[offset] += OP_TAIL_INVOKE_0 - OP_INVOKE_0;
+        continue;
+      }
+    }
+
+    switch (code[offset]) {
+      case OP_GET_LOCAL:
+        if (isBinaryOnLocal(chunk, offset)) {
+          code[offset] = code[next] == OP_GET_LOCAL ? OP_BINARY_LOCAL_LOCAL : OP_BINARY_LOCAL_CONSTANT;
+        } else if (code[next] == OP_GET_LOCAL && !isBinaryOnLocal(chunk, next)) {
+          // Don't swallow a local that's about to be used by an operator.
+          code[offset] = OP_GET_LOCAL_GET_LOCAL;
+        } else if (code[next] == OP_CONSTANT) {
+          code[offset] = OP_GET_LOCAL_CONSTANT;
+        }
+        break;
+      case OP_SET_LOCAL:
+        if (code[next] == OP_POP) code[offset] = OP_SET_LOCAL_POP;
+        break;
+      case OP_SET_GLOBAL:
+        if (code[next] == OP_POP) code[offset] = OP_SET_GLOBAL_POP;
+        break;
+      case OP_JUMP_FALSY:
+        if (code[next] == OP_POP) code[offset] = OP_JUMP_FALSY_POP;
+        break;
+      case OP_POP:
+        if (code[next] == OP_LOOP) code[offset] = OP_POP_LOOP;
+        break;
+    }
+  }
+}
+
 static ObjFunction* endCompiler() {
   if (parser.onExpression) {
     if (current->scopeDepth == 0 && parser.printResult) {
@@ -459,6 +601,12 @@ static ObjFunction* endCompiler() {
 
   ObjFunction* function = current->function;
 
+  if (!parser.hadError) {
+    // This reads the instructions before they're fused.
+    function->maxSlots = maxStackDepth(currentChunk(), function->arity + 1);
+    fuseInstructions(currentChunk());
+  }
+
 # if DEBUG_PRINT_CODE == 2
   if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "main");
@@ -516,11 +664,29 @@ static void declaration();
 static void lambda(bool canAssign);
 static ParseRule* getRule(TokenType type);
 static void expressionBp(BindingPower bp);
+static void infixOperators(BindingPower bp, bool canAssign, int start);
 
 static int identifierConstant(Token* name) {
   return makeConstant(OBJ_VAL(copyStringLength(name->start, name->length)));
 }
 
+// Module variables are referred to by their slot in the module, which is
+// added here if the variable hasn't been seen yet. It gets defined later, or
+// is an error to use if it never is.
+static int globalSlot(const char* name, int length) {
+  int slot = moduleVariableSlot(parser.module, copyStringLength(name, length));
+  if (slot > MAX_MODULE_VARIABLES) {
+    error("A module can only contain %d variables", MAX_MODULE_VARIABLES);
+    return 0;
+  }
+
+  return slot;
+}
+
+static inline int identifierGlobal(Token* name) {
+  return globalSlot(name->start, name->length);
+}
+
 static bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
@@ -617,7 +783,7 @@ static int parseVariable(const char* errorMessage, bool isMutable) {
   declareVariable(isMutable);
   if (current->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierGlobal(&parser.previous);
 }
 
 static void markInitialized() {
@@ -701,17 +867,18 @@ static void finishParameterList(Signature* signature) {
   } while (match(TOKEN_COMMA));
 }
 
-static void finishArgumentList(Signature* signature, const char* type, TokenType end) {
-  if (!check(end)) {
-    do {
-      if (matchLine() && match(TOKEN_INDENT)) parser.ignoreDedents++;
-      validateParameterCount(type, ++signature->arity, true);
-      expression();
-    } while (match(TOKEN_COMMA));
+// Compiles one or more arguments, separated by commas.
+static void argumentList(Signature* signature, const char* type) {
+  do {
+    if (matchLine() && match(TOKEN_INDENT)) parser.ignoreDedents++;
+    validateParameterCount(type, ++signature->arity, true);
+    expression();
+  } while (match(TOKEN_COMMA));
 
-    matchLine();
-  }
+  matchLine();
+}
 
+static void endArgumentList(Signature* signature, TokenType end) {
   if (end == TOKEN_RIGHT_PAREN) {
     expect(end, "Expecting ')' after arguments");
   } else {
@@ -720,6 +887,11 @@ static void finishArgumentList(Signature* signature, const char* type, TokenType
   }
 }
 
+static void finishArgumentList(Signature* signature, const char* type, TokenType end) {
+  if (!check(end)) argumentList(signature, type);
+  endArgumentList(signature, end);
+}
+
 static inline void emitSignatureArg(uint8_t instruction, Signature* signature) {
   char method[MAX_METHOD_SIGNATURE];
   int length;
@@ -729,7 +901,162 @@ static inline void emitSignatureArg(uint8_t instruction, Signature* signature) {
 }
 
 static inline void callSignature(int argCount, Signature* signature) {
-  emitSignatureArg(OP_INVOKE_0 + argCount, signature);
+  char method[MAX_METHOD_SIGNATURE];
+  int length;
+  signatureToString(signature, method, &length);
+
+  callMethod(argCount, method, length);
+}
+
+// Some operators have their own instructions, which the VM runs without a
+// method call when the operands are numbers (or booleans, for `not`). They
+// take the same arguments as OP_INVOKE, and call the method the same way when
+// the operands are anything else.
+static uint8_t operatorInstruction(const char* name, int arity) {
+  if (arity == 0) {
+    if (strcmp(name, "-") == 0) return OP_NEGATE;
+    if (strcmp(name, "not") == 0) return OP_NOT;
+    return OP_INVOKE_0;
+  }
+
+  if (strcmp(name, "+") == 0) return OP_ADD;
+  if (strcmp(name, "-") == 0) return OP_SUBTRACT;
+  if (strcmp(name, "*") == 0) return OP_MULTIPLY;
+  if (strcmp(name, "/") == 0) return OP_DIVIDE;
+  if (strcmp(name, "%") == 0) return OP_MODULO;
+  if (strcmp(name, "<") == 0) return OP_LESS;
+  if (strcmp(name, ">") == 0) return OP_GREATER;
+  if (strcmp(name, "<=") == 0) return OP_LESS_EQUAL;
+  if (strcmp(name, ">=") == 0) return OP_GREATER_EQUAL;
+  if (strcmp(name, "==") == 0) return OP_EQUAL;
+  if (strcmp(name, "!=") == 0) return OP_NOT_EQUAL;
+  return OP_INVOKE_1;
+}
+
+static void callOperator(const char* name, int arity) {
+  Signature signature = { name, (int)strlen(name), SIG_METHOD, arity };
+
+  char method[MAX_METHOD_SIGNATURE];
+  int length;
+  signatureToString(&signature, method, &length);
+
+  emitCachedArg(operatorInstruction(name, arity), makeConstant(OBJ_VAL(copyStringLength(method, length))));
+}
+
+// Reads the literal loaded by the code from [start] to [end], if that code is a
+// single instruction that loads one.
+static bool literalAt(int start, int end, Value* value) {
+  if (current->customWrite != NULL || start >= end) return false;
+
+  Chunk* chunk = currentChunk();
+  uint8_t* code = &chunk->code[start];
+  switch (*code) {
+    case OP_NONE: *value = NONE_VAL; break;
+    case OP_TRUE: *value = TRUE_VAL; break;
+    case OP_FALSE: *value = FALSE_VAL; break;
+    case OP_CONSTANT: {
+      if (end - start < 2) return false;
+      int constant = code[1];
+      if (constant & 0x80) {
+        if (end - start < 3) return false;
+        constant = ((constant & 0x7f) << 8) | code[2];
+      }
+      *value = chunk->constants.values[constant];
+      break;
+    }
+    default: return false;
+  }
+
+  return instructionSize(chunk, start) == end - start;
+}
+
+// Removes the code from [start] to the end of the chunk, which only loads
+// literals. Every literal adds its own constant, so the ones at the end of the
+// constant table go with it.
+static void dropLiterals(int start) {
+  Chunk* chunk = currentChunk();
+  for (int offset = start; offset < chunk->count; offset += instructionSize(chunk, offset)) {
+    if (chunk->code[offset] == OP_CONSTANT) chunk->constants.count--;
+  }
+
+  chunk->count = start;
+}
+
+// Replaces the literals loaded from [start] onwards with [result].
+static void replaceLiterals(int start, Value result) {
+  dropLiterals(start);
+
+  if (IS_BOOL(result)) emitByte(AS_BOOL(result) ? OP_TRUE : OP_FALSE);
+  else emitConstant(result);
+}
+
+// Works out an operator applied to literals while compiling. Only the cases the
+// VM handles without calling a method are folded, so the program computes the
+// same value either way.
+static bool foldBinary(const char* name, int leftStart, int rightStart) {
+  Value left;
+  Value right;
+  if (!literalAt(leftStart, rightStart, &left) ||
+      !literalAt(rightStart, currentChunk()->count, &right)) {
+    return false;
+  }
+
+  Value result;
+  if (IS_NUMBER(left) && IS_NUMBER(right)) {
+    double a = AS_NUMBER(left);
+    double b = AS_NUMBER(right);
+    switch (operatorInstruction(name, 1)) {
+      case OP_ADD:           result = numberToValue(a + b); break;
+      case OP_SUBTRACT:      result = numberToValue(a - b); break;
+      case OP_MULTIPLY:      result = numberToValue(a * b); break;
+      case OP_DIVIDE:        result = NUMBER_VAL(a / b); break;
+      case OP_MODULO:        result = numberToValue(numberModulo(a, b)); break;
+      case OP_LESS:          result = BOOL_VAL(a < b); break;
+      case OP_GREATER:       result = BOOL_VAL(a > b); break;
+      case OP_LESS_EQUAL:    result = BOOL_VAL(a <= b); break;
+      case OP_GREATER_EQUAL: result = BOOL_VAL(a >= b); break;
+      case OP_EQUAL:         result = BOOL_VAL(a == b); break;
+      case OP_NOT_EQUAL:     result = BOOL_VAL(a != b); break;
+      default: return false;
+    }
+  } else if ((IS_STRING(left) && IS_STRING(right)) || (IS_BOOL(left) && IS_BOOL(right))) {
+    if (strcmp(name, "==") == 0) {
+      result = BOOL_VAL(valuesEqual(left, right));
+    } else if (strcmp(name, "!=") == 0) {
+      result = BOOL_VAL(!valuesEqual(left, right));
+    } else if (strcmp(name, "+") == 0 && IS_STRING(left)) {
+      ObjString* a = AS_STRING(left);
+      ObjString* b = AS_STRING(right);
+      int length = a->length + b->length;
+      char* chars = ALLOCATE(char, length + 1);
+      memcpy(chars, a->chars, a->length);
+      memcpy(chars + a->length, b->chars, b->length);
+      chars[length] = '\0';
+      result = OBJ_VAL(takeString(chars, length));
+    } else {
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  replaceLiterals(leftStart, result);
+  return true;
+}
+
+static bool foldUnary(const char* name, int start) {
+  Value operand;
+  if (!literalAt(start, currentChunk()->count, &operand)) return false;
+
+  if (IS_NUMBER(operand) && strcmp(name, "-") == 0) {
+    replaceLiterals(start, numberToValue(-AS_NUMBER(operand)));
+  } else if (IS_BOOL(operand) && strcmp(name, "not") == 0) {
+    replaceLiterals(start, BOOL_VAL(!AS_BOOL(operand)));
+  } else {
+    return false;
+  }
+
+  return true;
 }
 
 void binarySignature(Signature* signature) {
@@ -802,7 +1129,7 @@ static void namedVariable(Token name, bool canAssign) {
       errorAtCurrent("Value cannot be reassigned");
     }
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierGlobal(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
@@ -873,7 +1200,36 @@ static void callable(bool canAssign) {
     signature.type = SIG_ATTRIBUTE;
   }
 
+  int bindStart = currentChunk()->count;
   emitSignatureArg(OP_BIND_METHOD, &signature);
+  if (signature.type != SIG_METHOD || !match(TOKEN_LEFT_PAREN)) return;
+
+  Signature call = { NULL, 0, SIG_METHOD, 0 };
+  finishArgumentList(&call, "Function", TOKEN_RIGHT_PAREN);
+
+  // Calling the bound method checks the number of arguments, which an invoke
+  // doesn't do, so a call with the wrong number is left as it is.
+  if (call.arity != signature.arity || current->customWrite != NULL) {
+    emitByte(OP_CALL_0 + call.arity);
+    return;
+  }
+
+  // A method that's called straight away is invoked instead, since the bound
+  // method would be thrown away right after the call. The arguments are moved
+  // back over the BIND_METHOD, and any jumps in them are relative, so they
+  // still land in the right place. The invoke has no field name, because '::'
+  // always picks the method, even when a field has the same name.
+  Chunk* chunk = currentChunk();
+  int constant = chunk->code[bindStart + 1];
+  if (constant & 0x80) constant = ((constant & 0x7f) << 8) | chunk->code[bindStart + 2];
+
+  int bindSize = instructionSize(chunk, bindStart);
+  int argsSize = chunk->count - bindStart - bindSize;
+  memmove(&chunk->code[bindStart], &chunk->code[bindStart + bindSize], argsSize);
+  memmove(&chunk->lines[bindStart], &chunk->lines[bindStart + bindSize], argsSize * sizeof(int));
+  chunk->count -= bindSize;
+
+  emitCachedArg(OP_INVOKE_0 + call.arity, constant);
 }
 
 static void dot(bool canAssign) {
@@ -886,12 +1242,12 @@ static void dot(bool canAssign) {
     if (matchLine() && match(TOKEN_INDENT)) parser.ignoreDedents++;
 
     expression();
-    emitVariableArg(OP_SET_PROPERTY, name);
+    emitCachedArg(OP_SET_PROPERTY, name);
   } else if (match(TOKEN_LEFT_PAREN)) {
     finishArgumentList(&signature, "Method", TOKEN_RIGHT_PAREN);
     callSignature(signature.arity, &signature);
   } else {
-    emitVariableArg(OP_GET_PROPERTY, name);
+    emitCachedArg(OP_GET_PROPERTY, name);
   }
 }
 
@@ -1009,24 +1365,24 @@ static void if_(bool canAssign) {
 }
 
 static void stringInterpolation(bool canAssign) {
-  emitConstantArg(OP_GET_GLOBAL, OBJ_VAL(copyStringLength("List", 4)));
+  emitVariableArg(OP_GET_GLOBAL, globalSlot("List", 4));
   emitByte(OP_CALL_0);
   int addConstant = makeConstant(OBJ_VAL(copyStringLength("addCore(1)", 10)));
 
   do {
     emitConstant(parser.previous.value);
-    emitVariableArg(OP_INVOKE_1, addConstant);
+    emitInvoke(1, addConstant);
 
     matchLine();
     expression();
-    emitVariableArg(OP_INVOKE_1, addConstant);
+    emitInvoke(1, addConstant);
 
     matchLine();
   } while (match(TOKEN_INTERPOLATION));
 
   expect(TOKEN_STRING, "Expecting an end to string interpolation");
   emitConstant(parser.previous.value);
-  emitVariableArg(OP_INVOKE_1, addConstant);
+  emitInvoke(1, addConstant);
 
   emitConstant(OBJ_VAL(copyStringLength("", 0)));
   callMethod(1, "joinToString(1)", 15);
@@ -1034,12 +1390,12 @@ static void stringInterpolation(bool canAssign) {
 
 static void collection(bool canAssign) {
   if (match(TOKEN_RIGHT_BRACKET)) {
-    emitConstantArg(OP_GET_GLOBAL, OBJ_VAL(copyStringLength("List", 4)));
+    emitVariableArg(OP_GET_GLOBAL, globalSlot("List", 4));
     emitByte(OP_CALL_0);
     return;
   } else if (match(TOKEN_RIGHT_ARROW)) {
     expect(TOKEN_RIGHT_BRACKET, "Expecting ']' to end empty map");
-    emitConstantArg(OP_GET_GLOBAL, OBJ_VAL(copyStringLength("Map", 3)));
+    emitVariableArg(OP_GET_GLOBAL, globalSlot("Map", 3));
     emitByte(OP_CALL_0);
     return;
   }
@@ -1066,8 +1422,7 @@ static void collection(bool canAssign) {
   bool isMap = match(TOKEN_RIGHT_ARROW);
   bool first = true;
 
-  emitConstantArg(OP_GET_GLOBAL, isMap ? OBJ_VAL(copyStringLength("Map", 3))
-                                       : OBJ_VAL(copyStringLength("List", 4)));
+  emitVariableArg(OP_GET_GLOBAL, isMap ? globalSlot("Map", 3) : globalSlot("List", 4));
   emitByte(OP_CALL_0);
 
   do {
@@ -1117,9 +1472,47 @@ static void collection(bool canAssign) {
 
 static void subscript(bool canAssign) {
   Signature signature = { "get", 3, SIG_METHOD, 0, NULL };
-  finishArgumentList(&signature, "Method", TOKEN_RIGHT_BRACKET);
 
+  // A single index that's written as a range, like 'list[a..b]', is left on
+  // the stack as its two ends, so lists and strings can be sliced without
+  // making a Range.
+  bool isSlice = false;
+  bool isInclusive = false;
+  if (!check(TOKEN_RIGHT_BRACKET) && current->customWrite == NULL) {
+    if (matchLine() && match(TOKEN_INDENT)) parser.ignoreDedents++;
+    validateParameterCount("Method", ++signature.arity, true);
+
+    int start = currentChunk()->count;
+    expressionBp((BindingPower)(BP_RANGE + 1));
+    if (match(TOKEN_DOT_DOT) || match(TOKEN_DOT_DOT_LT)) {
+      isInclusive = parser.previous.type == TOKEN_DOT_DOT;
+      if (matchLine() && match(TOKEN_INDENT)) parser.ignoreDedents++;
+      expressionBp((BindingPower)(BP_RANGE + 1));
+
+      isSlice = check(TOKEN_RIGHT_BRACKET);
+      if (!isSlice) callOperator(isInclusive ? ".." : "..<", 1);
+    }
+
+    if (!isSlice) infixOperators(BP_ASSIGNMENT, false, start);
+
+    // Any other arguments come after a comma, like in finishArgumentList.
+    if (match(TOKEN_COMMA)) argumentList(&signature, "Method");
+    else matchLine();
+    endArgumentList(&signature, TOKEN_RIGHT_BRACKET);
+  } else {
+    finishArgumentList(&signature, "Method", TOKEN_RIGHT_BRACKET);
+  }
+
+  int sliceJump = -1;
+  if (isSlice) {
+    // Assigning to a slice calls set() with the Range.
+    if (!(canAssign && check(TOKEN_EQ))) sliceJump = emitByteJump(OP_SLICE, isInclusive);
+    callOperator(isInclusive ? ".." : "..<", 1);
+  }
+
+  bool isSet = false;
   if (canAssign && match(TOKEN_EQ)) {
+    isSet = true;
     if (matchLine() && match(TOKEN_INDENT)) parser.ignoreDedents++;
 
     expression();
@@ -1127,7 +1520,18 @@ static void subscript(bool canAssign) {
     signature.name = "set";
   }
 
-  callSignature(signature.arity, &signature);
+  // Subscripts with a single index have their own instructions, which read
+  // and write lists and tuples without calling the method.
+  uint8_t instruction = OP_INVOKE_0 + signature.arity;
+  if (!isSet && signature.arity == 1) instruction = OP_GET_SUBSCRIPT;
+  if (isSet && signature.arity == 2) instruction = OP_SET_SUBSCRIPT;
+
+  char method[MAX_METHOD_SIGNATURE];
+  int length;
+  signatureToString(&signature, method, &length);
+  emitInvokeInstruction(instruction, makeConstant(OBJ_VAL(copyStringLength(method, length))));
+
+  if (sliceJump != -1) patchJump(sliceJump);
 }
 
 static bool chainedComparison(ParseRule* rule) {
@@ -1163,8 +1567,7 @@ static bool chainedComparison(ParseRule* rule) {
     emitBytes(OP_SET_LOCAL, slotA);
     emitByte(OP_POP);
 
-    Signature signature = { rule->name, (int)strlen(rule->name), SIG_METHOD, 1 };
-    callSignature(1, &signature);
+    callOperator(rule->name, 1);
 
     int jump = emitJump(OP_JUMP_FALSY);
 
@@ -1186,8 +1589,7 @@ static bool chainedComparison(ParseRule* rule) {
     next = potential;
   }
 
-  Signature nextSignature = { next->name, (int)strlen(next->name), SIG_METHOD, 1 };
-  callSignature(1, &nextSignature);
+  callOperator(next->name, 1);
   
   int endJump = emitJump(OP_JUMP);
 
@@ -1205,6 +1607,7 @@ static bool chainedComparison(ParseRule* rule) {
 }
 
 static void binary(bool canAssign) {
+  int leftStart = parser.operandStart;
   TokenType operatorType = parser.previous.type;
   ParseRule* rule = getRule(operatorType);
 
@@ -1212,6 +1615,7 @@ static void binary(bool canAssign) {
 
   if (matchLine() && match(TOKEN_INDENT)) parser.ignoreDedents++;
 
+  int rightStart = currentChunk()->count;
   if (operatorType == TOKEN_STAR_STAR) {
     expressionBp((BindingPower)(rule->bp));
   } else {
@@ -1219,11 +1623,10 @@ static void binary(bool canAssign) {
   }
 
   if (chainedComparison(rule)) return;
+  if (!negate && foldBinary(rule->name, leftStart, rightStart)) return;
 
-  Signature signature = { rule->name, (int)strlen(rule->name), SIG_METHOD, 1 };
-
-  callSignature(1, &signature);
-  if (negate) callMethod(0, "not()", 5);
+  callOperator(rule->name, 1);
+  if (negate) callOperator("not", 0);
 }
 
 static void unary(bool canAssign) {
@@ -1233,11 +1636,11 @@ static void unary(bool canAssign) {
   if (matchLine() && match(TOKEN_INDENT)) parser.ignoreDedents++;
 
   // Compile the operand.
+  int start = currentChunk()->count;
   expressionBp(operatorType == TOKEN_NOT ? BP_NOT : BP_UNARY);
 
-  Signature signature = { rule->name, (int)strlen(rule->name), SIG_METHOD, 0 };
-
-  callSignature(0, &signature);
+  if (foldUnary(rule->name, start)) return;
+  callOperator(rule->name, 0);
 }
 
 #define UNUSED                    { NULL,   NULL,   BP_NONE, NULL, NULL }
@@ -1326,20 +1729,14 @@ ParseRule rules[] = {
   /* TOKEN_NULL          */ UNUSED, // The compiler should never see a null token.
 };
 
-static void expressionBp(BindingPower bp) {
-  advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
-  if (prefixRule == NULL) {
-    error("Expecting an expression");
-    return;
-  }
-
-  bool canAssign = bp <= BP_ASSIGNMENT;
-  prefixRule(canAssign);
-
+// Compiles the operators that follow an operand which is already compiled, as
+// long as they bind at least as tightly as [bp]. The operand's code begins at
+// [start].
+static void infixOperators(BindingPower bp, bool canAssign, int start) {
   while (bp <= getRule(parser.current.type)->bp) {
     advance();
     ParseFn infixRule = getRule(parser.previous.type)->infix;
+    parser.operandStart = start;
     infixRule(canAssign);
   }
 
@@ -1349,6 +1746,20 @@ static void expressionBp(BindingPower bp) {
   }
 }
 
+static void expressionBp(BindingPower bp) {
+  advance();
+  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+  if (prefixRule == NULL) {
+    error("Expecting an expression");
+    return;
+  }
+
+  int start = currentChunk()->count;
+  bool canAssign = bp <= BP_ASSIGNMENT;
+  prefixRule(canAssign);
+  infixOperators(bp, canAssign, start);
+}
+
 static inline ParseRule* getRule(TokenType type) { return &rules[type]; }
 
 static void expression() { expressionBp(BP_ASSIGNMENT); }
@@ -1504,7 +1915,7 @@ static void method() {
         emitBytes(OP_GET_LOCAL, 0);
         emitBytes(OP_GET_LOCAL, i + 1);
         Local local = current->locals[i + 1];
-        emitVariableArg(OP_SET_PROPERTY, identifierConstant(&local.name));
+        emitCachedArg(OP_SET_PROPERTY, identifierConstant(&local.name));
         emitByte(OP_POP);
       }
     }
@@ -1540,6 +1951,7 @@ static void classDeclaration() {
   expect(TOKEN_IDENTIFIER, "Expecting a class name");
   Token className = parser.previous;
   int nameConstant = identifierConstant(&parser.previous);
+  int global = current->scopeDepth > 0 ? 0 : identifierGlobal(&parser.previous);
   declareVariable(false);
 
   if (match(TOKEN_LT)) {
@@ -1550,11 +1962,11 @@ static void classDeclaration() {
       error("A class can't inherit from itself");
     }
   } else {
-    emitConstantArg(OP_GET_GLOBAL, OBJ_VAL(copyString("Object")));
+    emitVariableArg(OP_GET_GLOBAL, globalSlot("Object", 6));
   }
 
   emitVariableArg(OP_CLASS, nameConstant);
-  defineVariable(nameConstant, false);
+  defineVariable(global, false);
 
   ClassCompiler classCompiler;
   classCompiler.enclosing = currentClass;
@@ -1627,7 +2039,13 @@ static void varDeclaration() {
     //   warning("");
     // }
 
+    // Tuples and lists are unpacked by the VM. Anything else goes through
+    // count and get(), which UNPACK jumps over. Either way, the values end up
+    // on the stack above the original.
+    int unpackJump = -1;
     if (!isNone) {
+      unpackJump = emitByteJump(OP_UNPACK, (uint8_t)vars.count);
+
       emitBytes(OP_DUP, 0);
       callMethod(0, "count", 5);
       emitConstant(NUMBER_VAL((uint8_t)vars.count));
@@ -1645,12 +2063,16 @@ static void varDeclaration() {
     }
 
     for (int i = 0; i < vars.count; i++) {
-      emitBytes(OP_DUP, 0);
+      emitBytes(OP_DUP, (uint8_t)i);
       if (!isNone) {
         emitConstant(NUMBER_VAL((uint8_t)i));
         callMethod(1, "get(1)", 6);
       }
+    }
+
+    if (unpackJump != -1) patchJump(unpackJump);
 
+    for (int i = vars.count - 1; i >= 0; i--) {
       if (current->scopeDepth == 0) {
         defineVariable(vars.data[i], isMutable);
       } else {
@@ -1696,11 +2118,11 @@ static void useStatement() {
 
   int variableCount = 0;
   IntArray sourceConstants;
-  IntArray nameConstants;
+  IntArray nameGlobals;
 
   if (!check(TOKEN_STRING)) {
     intArrayInit(&sourceConstants);
-    intArrayInit(&nameConstants);
+    intArrayInit(&nameGlobals);
     do {
       matchLine();
 
@@ -1708,15 +2130,16 @@ static void useStatement() {
 
       variableCount++;
       int sourceConstant = identifierConstant(&parser.previous);
-      int nameConstant = sourceConstant;
+      int nameGlobal;
       if (match(TOKEN_RIGHT_ARROW)) {
-        nameConstant = parseVariable("Expecting a variable name alias", false);
+        nameGlobal = parseVariable("Expecting a variable name alias", false);
       } else {
+        nameGlobal = current->scopeDepth > 0 ? 0 : identifierGlobal(&parser.previous);
         declareVariable(false);
       }
 
       intArrayWrite(&sourceConstants, sourceConstant);
-      intArrayWrite(&nameConstants, nameConstant);
+      intArrayWrite(&nameGlobals, nameGlobal);
     } while (match(TOKEN_COMMA));
 
     expect(TOKEN_IDENTIFIER, "Expecting 'from' after import variables");
@@ -1733,7 +2156,7 @@ static void useStatement() {
   if (variableCount > 0) {
     for (int i = 0; i < variableCount; i++) {
       emitVariableArg(OP_IMPORT_VARIABLE, sourceConstants.data[i]);
-      defineVariable(nameConstants.data[i], false);
+      defineVariable(nameGlobals.data[i], false);
     }
   }
 }
@@ -1853,6 +2276,17 @@ static void returnStatement() {
   }
 }
 
+// Checks if the code from [start] to the end of the chunk loads a literal, and
+// if so removes it and sets [isTruthy] to what a jump would make of it.
+static bool literalCondition(int start, bool* isTruthy) {
+  Value condition;
+  if (!literalAt(start, currentChunk()->count, &condition)) return false;
+
+  *isTruthy = !IS_NONE(condition) && !(IS_BOOL(condition) && !AS_BOOL(condition));
+  dropLiterals(start);
+  return true;
+}
+
 static void whileStatement() {
   Token* label = NULL;
   if (match(TOKEN_COLON)) {
@@ -1868,8 +2302,18 @@ static void whileStatement() {
 
   expression(); // Condition
 
-  current->loop->exitJump = emitJump(OP_JUMP_FALSY);
-  emitByte(OP_POP);
+  // A literal condition isn't checked at all. If it's falsy, the whole loop is
+  // dead code.
+  bool isTruthy;
+  bool isLiteral = literalCondition(loop.start, &isTruthy);
+  DeadCode dead = { 0 };
+  if (isLiteral) {
+    current->loop->exitJump = -1;
+    if (!isTruthy) startDeadCode(&dead);
+  } else {
+    current->loop->exitJump = emitJump(OP_JUMP_FALSY);
+    emitByte(OP_POP);
+  }
 
   if (match(TOKEN_DO) && !check(TOKEN_LINE)) {
     statement();
@@ -1880,6 +2324,7 @@ static void whileStatement() {
   }
 
   endLoop();
+  if (isLiteral && !isTruthy) endDeadCode(&dead);
 
   FREE(Token, label);
 }
@@ -1962,13 +2407,46 @@ static void eachStatement() {
   expect(TOKEN_IN, "Expecting 'in' after loop variable");
   matchLine();
 
-  expression();
+  // A range written right after 'in', like 'each i in 0..<count', is counted
+  // through without making a Range, as long as both ends are numbers.
+  bool isRange = false;
+  bool isInclusive = false;
+  int sequenceStart = currentChunk()->count;
+  expressionBp((BindingPower)(BP_RANGE + 1));
+  if (match(TOKEN_DOT_DOT) || match(TOKEN_DOT_DOT_LT)) {
+    isInclusive = parser.previous.type == TOKEN_DOT_DOT;
+    if (matchLine() && match(TOKEN_INDENT)) parser.ignoreDedents++;
+    expressionBp((BindingPower)(BP_RANGE + 1));
 
-  if (current->localCount + 2 > UINT8_COUNT) {
+    if (check(TOKEN_DO) || check(TOKEN_LINE)) {
+      isRange = true;
+    } else {
+      callOperator(isInclusive ? ".." : "..<", 1);
+      infixOperators(BP_ASSIGNMENT, false, sequenceStart);
+    }
+  } else {
+    infixOperators(BP_ASSIGNMENT, false, sequenceStart);
+  }
+
+  if (current->localCount + 3 > UINT8_COUNT) {
     error("Cannot declare any more locals.");
     return;
   }
 
+  // When both ends are numbers, RANGE_START replaces them with the end, the
+  // first number and the step, then jumps to the body. Otherwise the operator
+  // makes the sequence like it usually would.
+  int rangeTestJump = -1;
+  int rangeBodyJump = -1;
+  if (isRange) {
+    emitBytes(OP_RANGE_START, isInclusive);
+    emitBytes(0xff, 0xff);
+    rangeTestJump = currentChunk()->count - 2;
+    emitBytes(0xff, 0xff);
+    rangeBodyJump = currentChunk()->count - 2;
+    callOperator(isInclusive ? ".." : "..<", 1);
+  }
+
   addLocal(syntheticToken("`seq"), false);
   markInitialized();
   int seqSlot = current->localCount - 1;
@@ -1976,22 +2454,43 @@ static void eachStatement() {
   addLocal(syntheticToken("`iter"), false);
   markInitialized();
   int iterSlot = current->localCount - 1;
+  if (isRange) {
+    emitByte(OP_NONE);
+    addLocal(syntheticToken("`step"), false);
+    markInitialized();
+  }
 
   Loop loop;
   startLoop(&loop);
 
+  // Lists, tuples, ranges and strings are stepped through by ITER_NEXT, which
+  // jumps straight to the body with the next value, or to the exit check when
+  // there isn't one. Anything else falls through to iterate() and
+  // iteratorValue(). RANGE_NEXT does the same, but counts by the step first if
+  // there is one.
+  emitBytes(isRange ? OP_RANGE_NEXT : OP_ITER_NEXT, seqSlot);
+  emitBytes(0xff, 0xff);
+  int testJump = currentChunk()->count - 2;
+  emitBytes(0xff, 0xff);
+  int bodyJump = currentChunk()->count - 2;
+  if (isRange) emitByte(isInclusive);
+
   emitBytes(OP_GET_LOCAL, seqSlot);
   emitBytes(OP_GET_LOCAL, iterSlot);
 
   callMethod(1, "iterate(1)", 10);
   emitBytes(OP_SET_LOCAL, iterSlot);
 
+  patchJump(testJump);
+  if (isRange) patchJump(rangeTestJump);
   current->loop->exitJump = emitJump(OP_JUMP_FALSY);
 
   emitByte(OP_POP);
   emitBytes(OP_GET_LOCAL, seqSlot);
   emitBytes(OP_GET_LOCAL, iterSlot);
   callMethod(1, "iteratorValue(1)", 16);
+  patchJump(bodyJump);
+  if (isRange) patchJump(rangeBodyJump);
 
   pushScope(); // Loop variable
   addLocal(name, false);
@@ -2014,14 +2513,25 @@ static void eachStatement() {
 
   endLoop();
 
-  popScope(); // `seq and `iter variables
+  popScope(); // Hidden iterator variables
 }
 
 static void ifStatement() {
+  int conditionStart = currentChunk()->count;
   expression();
 
-  int thenJump = emitJump(OP_JUMP_FALSY);
-  emitByte(OP_POP);
+  // A literal condition picks the branch right here, and the other branch is
+  // dead code.
+  bool isTruthy;
+  bool isLiteral = literalCondition(conditionStart, &isTruthy);
+  DeadCode dead = { 0 };
+  int thenJump = -1;
+  if (isLiteral) {
+    if (!isTruthy) startDeadCode(&dead);
+  } else {
+    thenJump = emitJump(OP_JUMP_FALSY);
+    emitByte(OP_POP);
+  }
 
   if (match(TOKEN_DO) && !check(TOKEN_LINE)) {
     statement();
@@ -2031,10 +2541,15 @@ static void ifStatement() {
     scopedBlock();
   }
 
-  int elseJump = emitJump(OP_JUMP);
-
-  patchJump(thenJump);
-  emitByte(OP_POP);
+  int elseJump = -1;
+  if (isLiteral) {
+    if (isTruthy) startDeadCode(&dead);
+    else endDeadCode(&dead);
+  } else {
+    elseJump = emitJump(OP_JUMP);
+    patchJump(thenJump);
+    emitByte(OP_POP);
+  }
 
   if (match(TOKEN_ELIF)) ifStatement();
   else if (match(TOKEN_ELSE)) {
@@ -2046,13 +2561,27 @@ static void ifStatement() {
       scopedBlock();
     }
   }
-  patchJump(elseJump);
+
+  if (!isLiteral) patchJump(elseJump);
+  else if (isTruthy) endDeadCode(&dead);
 }
 
 #define MAX_WHEN_CASES 256
 
+// Works out whether two literals are equal while compiling, for the kinds of
+// values whose '==' doesn't depend on anything but the values themselves.
+static bool literalsEqual(Value a, Value b, bool* isEqual) {
+  if ((IS_NUMBER(a) && IS_NUMBER(b)) || (IS_STRING(a) && IS_STRING(b)) || (IS_BOOL(a) && IS_BOOL(b))) {
+    *isEqual = valuesEqual(a, b);
+    return true;
+  }
+
+  return false;
+}
+
 // TODO: Review when statements, the code is old and unpolished.
 static void whenStatement() {
+  int valueStart = currentChunk()->count;
   expression();
   match(TOKEN_DO);
 
@@ -2063,6 +2592,14 @@ static void whenStatement() {
   //   == 3 do somethingElse()
   //   3 do somethingElse() # same as ==
 
+  // A literal value is compared with cases that are all literals right here,
+  // like the condition of an if. A case that can't match is dead code, and so
+  // is everything after a case that always matches.
+  Value value;
+  bool isLiteral = literalAt(valueStart, currentChunk()->count, &value);
+  bool isMatched = false;
+  DeadCode rest = { 0 };
+
   expectLine("Expecting a newline before cases");
   expect(TOKEN_INDENT, "Expecting an indent before cases");
   matchLine();
@@ -2079,7 +2616,8 @@ static void whenStatement() {
       error("Can't have any cases after the default case");
     }
 
-    if (state == 1) {
+    // Only a case that was checked at runtime has a jump to patch.
+    if (previousCaseSkip != -1) {
       if (caseCount == MAX_WHEN_CASES) {
         error("When statements cannot have more than %d cases", MAX_WHEN_CASES);
       }
@@ -2088,33 +2626,57 @@ static void whenStatement() {
 
       patchJump(previousCaseSkip);
       emitByte(OP_POP);
+      previousCaseSkip = -1;
     }
 
+    bool isKnown = false;
+    bool isEqual = false;
+    DeadCode dead = { 0 };
+
     if (match(TOKEN_ELSE)) {
       if (state == 0) {
         error("Can't have a default case first");
       }
 
       state = 2;
-      previousCaseSkip = -1;
     } else {
       state = 1;
 
-      emitConstantArg(OP_GET_GLOBAL, OBJ_VAL(copyStringLength("List", 4)));
+      DeadCode test;
+      startDeadCode(&test);
+      isKnown = isLiteral && !isMatched;
+
+      emitVariableArg(OP_GET_GLOBAL, globalSlot("List", 4));
       emitByte(OP_CALL_0);
       int addConstant = makeConstant(OBJ_VAL(copyStringLength("addCore(1)", 10)));
 
       do {
+        int caseStart = currentChunk()->count;
         expression();
-        emitVariableArg(OP_INVOKE_1, addConstant);
+
+        Value caseValue;
+        bool isCaseEqual;
+        if (isKnown && literalAt(caseStart, currentChunk()->count, &caseValue) &&
+            literalsEqual(value, caseValue, &isCaseEqual)) {
+          isEqual = isEqual || isCaseEqual;
+        } else {
+          isKnown = false;
+        }
+
+        emitInvoke(1, addConstant);
       } while (match(TOKEN_COMMA));
 
-      emitBytes(OP_DUP, 1);
+      if (isKnown) {
+        endDeadCode(&test);
+        if (!isEqual) startDeadCode(&dead);
+      } else {
+        emitBytes(OP_DUP, 1);
 
-      callMethod(1, "contains(1)", 11);
-      previousCaseSkip = emitJump(OP_JUMP_FALSY);
+        callMethod(1, "contains(1)", 11);
+        previousCaseSkip = emitJump(OP_JUMP_FALSY);
 
-      emitByte(OP_POP); // Comparison result
+        emitByte(OP_POP); // Comparison result
+      }
     }
 
     if (match(TOKEN_DO) && !check(TOKEN_LINE)) {
@@ -2125,12 +2687,32 @@ static void whenStatement() {
       expect(TOKEN_INDENT, "Expecting an indent before body");
       scopedBlock();
     }
+
+    if (isKnown && !isEqual) endDeadCode(&dead);
+    if (isKnown && isEqual) {
+      isMatched = true;
+      startDeadCode(&rest);
+    }
   }
 
   if (!check(TOKEN_EOF)) expect(TOKEN_DEDENT, "Expecting indentation to decrease after cases");
 
-  // If there is no default case, patch the jump.
-  if (state == 1) {
+  // Any jumps in the cases that were thrown away are gone too.
+  if (isMatched) {
+    endDeadCode(&rest);
+    previousCaseSkip = -1;
+    while (caseCount > 0 && caseEnds[caseCount - 1] >= rest.count) caseCount--;
+  }
+
+  // If there is no default case, the last case still has to jump over the pop
+  // of its comparison result.
+  if (previousCaseSkip != -1) {
+    if (caseCount == MAX_WHEN_CASES) {
+      error("When statements cannot have more than %d cases", MAX_WHEN_CASES);
+    }
+
+    caseEnds[caseCount++] = emitJump(OP_JUMP);
+
     patchJump(previousCaseSkip);
     emitByte(OP_POP);
   }
@@ -152,10 +152,16 @@ DEF_NATIVE(list_iterate) {
     RETURN_NUMBER(0);
   }
 
+  if (IS_INT(args[1])) {
+    int32_t index = AS_INT(args[1]);
+    if (index < 0 || (uint32_t)index + 1 >= list->count) RETURN_FALSE();
+    RETURN_VAL(INT_VAL(index + 1));
+  }
+
   if (!validateInt(args[1], "Iterator")) return false;
 
   double index = AS_NUMBER(args[1]);
-  if (index < 0 || index >= list->count - 1) RETURN_FALSE();
+  if (index < 0 || index + 1 >= list->count) RETURN_FALSE();
 
   RETURN_NUMBER(index + 1);
 }
@@ -240,6 +246,244 @@ DEF_NATIVE(list_set) {
   RETURN_VAL(args[2]);
 }
 
+// These call back into the VM for every item, which can change the list, so
+// its count is read again each time, like an each loop would.
+
+DEF_NATIVE(list_forEach) {
+  ObjList* list = AS_LIST(args[0]);
+  for (uint32_t i = 0; i < list->count; i++) {
+    Value ignored;
+    CALL_VALUE(args[1], 1, &list->items[i], &ignored);
+  }
+
+  RETURN_NONE();
+}
+
+DEF_NATIVE(list_map) {
+  ObjList* list = AS_LIST(args[0]);
+  ObjList* result = newList(0);
+  // Everything made here is kept on the stack, so it's rooted.
+  push(OBJ_VAL(result));
+
+  for (uint32_t i = 0; i < list->count; i++) {
+    Value item;
+    CALL_VALUE(args[1], 1, &list->items[i], &item);
+    push(item);
+    listAppend(result, item);
+    pop();
+  }
+
+  pop();
+  RETURN_OBJ(result);
+}
+
+DEF_NATIVE(list_filter) {
+  ObjList* list = AS_LIST(args[0]);
+  ObjList* result = newList(0);
+  push(OBJ_VAL(result));
+
+  for (uint32_t i = 0; i < list->count; i++) {
+    // The predicate could remove the item from the list.
+    Value item = list->items[i];
+    push(item);
+
+    Value keep;
+    CALL_VALUE(args[1], 1, &item, &keep);
+    if (!isFalsy(keep)) listAppend(result, item);
+    pop();
+  }
+
+  pop();
+  RETURN_OBJ(result);
+}
+
+DEF_NATIVE(list_reduce) {
+  ObjList* list = AS_LIST(args[0]);
+  for (uint32_t i = 0; i < list->count; i++) {
+    Value callArgs[2] = { args[1], list->items[i] };
+    Value acc;
+    CALL_VALUE(args[2], 2, callArgs, &acc);
+    // The accumulator stays rooted in its argument slot.
+    args[1] = acc;
+  }
+
+  RETURN_VAL(args[1]);
+}
+
+// Lists are sorted with a merge sort, which is stable and never worse than
+// O(n log n). Short runs are insertion sorted first, and runs that are already
+// in order are copied instead of merged, so sorted input takes O(n) compares.
+#define SORT_RUN 16
+
+typedef enum {
+  SORT_NUMBERS,
+  SORT_STRINGS,
+  SORT_COMPARER
+} SortKind;
+
+typedef struct {
+  SortKind kind;
+  Value comparer;
+} Sorter;
+
+static int compareStrings(ObjString* a, ObjString* b) {
+  int length = a->length < b->length ? a->length : b->length;
+  int result = memcmp(a->chars, b->chars, length);
+  if (result != 0) return result;
+  return a->length - b->length;
+}
+
+// Sets [inOrder] to whether [a] can stay in front of [b]. Returns false if
+// the comparer raised an error.
+static inline bool sortInOrder(Sorter* sorter, Value a, Value b, bool* inOrder) {
+  switch (sorter->kind) {
+    case SORT_NUMBERS:
+      *inOrder = AS_NUMBER(a) <= AS_NUMBER(b);
+      return true;
+    case SORT_STRINGS:
+      *inOrder = compareStrings(AS_STRING(a), AS_STRING(b)) <= 0;
+      return true;
+    case SORT_COMPARER: {
+      Value callArgs[2] = { a, b };
+      Value result;
+      if (!vmCallValue(sorter->comparer, 2, callArgs, &result)) return false;
+      *inOrder = !isFalsy(result);
+      return true;
+    }
+  }
+
+  return false; // Unreachable.
+}
+
+static bool insertionSort(Sorter* sorter, Value* items, uint32_t start, uint32_t end) {
+  for (uint32_t i = start + 1; i < end; i++) {
+    Value item = items[i];
+    uint32_t j = i;
+    while (j > start) {
+      bool inOrder;
+      if (!sortInOrder(sorter, items[j - 1], item, &inOrder)) return false;
+      if (inOrder) break;
+      items[j] = items[j - 1];
+      j--;
+    }
+    items[j] = item;
+  }
+
+  return true;
+}
+
+// Merges the sorted runs from [start] to [mid] and from [mid] to [end] of [from]
+// into the same place in [to].
+static bool mergeRuns(Sorter* sorter, Value* from, Value* to, uint32_t start, uint32_t mid, uint32_t end) {
+  bool inOrder = true;
+  if (mid < end && !sortInOrder(sorter, from[mid - 1], from[mid], &inOrder)) return false;
+  if (inOrder) {
+    memcpy(to + start, from + start, sizeof(Value) * (end - start));
+    return true;
+  }
+
+  uint32_t left = start;
+  uint32_t right = mid;
+  uint32_t out = start;
+  while (left < mid && right < end) {
+    if (!sortInOrder(sorter, from[left], from[right], &inOrder)) return false;
+    to[out++] = inOrder ? from[left++] : from[right++];
+  }
+
+  memcpy(to + out, from + left, sizeof(Value) * (mid - left));
+  out += mid - left;
+  memcpy(to + out, from + right, sizeof(Value) * (end - right));
+  return true;
+}
+
+// Sorts the [count] values in [items], using [scratch], which has room for as
+// many, to merge into.
+static bool mergeSort(Sorter* sorter, Value* items, Value* scratch, uint32_t count) {
+  for (uint32_t start = 0; start < count; start += SORT_RUN) {
+    uint32_t end = count - start < SORT_RUN ? count : start + SORT_RUN;
+    if (!insertionSort(sorter, items, start, end)) return false;
+  }
+
+  Value* from = items;
+  Value* to = scratch;
+  for (size_t width = SORT_RUN; width < count; width *= 2) {
+    for (size_t start = 0; start < count; start += 2 * width) {
+      uint32_t mid = (uint32_t)(start + width < count ? start + width : count);
+      uint32_t end = (uint32_t)(start + 2 * width < count ? start + 2 * width : count);
+      if (!mergeRuns(sorter, from, to, (uint32_t)start, mid, end)) return false;
+    }
+
+    Value* merged = to;
+    to = from;
+    from = merged;
+  }
+
+  if (from != items) memcpy(items, from, sizeof(Value) * count);
+  return true;
+}
+
+// Sorts the list without a comparer when every item is a Number, or every item
+// is a String, and returns whether it did. Other lists are left to sort(), which
+// compares them with <=.
+DEF_NATIVE(list_sortCore) {
+  ObjList* list = AS_LIST(args[0]);
+  if (list->count < 2) RETURN_TRUE();
+
+  Sorter sorter;
+  sorter.kind = IS_STRING(list->items[0]) ? SORT_STRINGS : SORT_NUMBERS;
+  sorter.comparer = NONE_VAL;
+  for (uint32_t i = 0; i < list->count; i++) {
+    Value item = list->items[i];
+    if (sorter.kind == SORT_NUMBERS ? !IS_NUMBER(item) : !IS_STRING(item)) RETURN_FALSE();
+  }
+
+  // Nothing is called while sorting, so nothing can be collected either, and
+  // the items can be sorted right where they are.
+  Value* scratch = ALLOCATE(Value, list->count);
+  mergeSort(&sorter, list->items, scratch, list->count);
+  FREE_ARRAY(Value, scratch, list->count);
+  RETURN_TRUE();
+}
+
+DEF_NATIVE(list_sort) {
+  if (!validateFunction(args[1], "Comparer")) return false;
+
+  ObjList* list = AS_LIST(args[0]);
+  uint32_t count = list->count;
+  if (count < 2) RETURN_NONE();
+
+  // The comparer could change the list while it's being sorted, so a copy of
+  // it is sorted instead. That and the scratch space are lists on the stack,
+  // which keeps whatever is in them rooted.
+  ObjList* sorted = newList(count);
+  memcpy(sorted->items, list->items, sizeof(Value) * count);
+  push(OBJ_VAL(sorted));
+  ObjList* scratch = newList(count);
+  memcpy(scratch->items, list->items, sizeof(Value) * count);
+  push(OBJ_VAL(scratch));
+
+  Sorter sorter;
+  sorter.kind = SORT_COMPARER;
+  sorter.comparer = args[1];
+
+  ptrdiff_t argsOffset = args - vm.stack;
+  bool success = mergeSort(&sorter, sorted->items, scratch->items, count);
+  args = vm.stack + argsOffset;
+
+  // An error in the comparer has already reset the stack.
+  if (!success) return false;
+
+  // Otherwise the copies come off the stack either way. Nothing is allocated
+  // after this, so the sorted items can still be copied back.
+  pop();
+  pop();
+
+  if (list->count != count) RETURN_ERROR("List was changed while sorting");
+
+  memcpy(list->items, sorted->items, sizeof(Value) * count);
+  RETURN_NONE();
+}
+
 //////////////////
 // Map          //
 //////////////////
@@ -419,11 +663,15 @@ DEF_NUM_INFIX(gt,       >,  BOOL)
 DEF_NUM_INFIX(lte,      <=, BOOL)
 DEF_NUM_INFIX(gte,      >=, BOOL)
 
+// Ints convert to 32 bits directly, without going through a double.
+#define AS_BITS(value) \
+  (IS_INT(value) ? (uint32_t)AS_INT(value) : (uint32_t)AS_NUMBER(value))
+
 #define DEF_NUM_BITWISE(name, op)                                \
   DEF_NATIVE(number_bitwise##name) {                             \
     if (!validateNumber(args[1], "Right operand")) return false; \
-    uint32_t left = (uint32_t)AS_NUMBER(args[0]);                \
-    uint32_t right = (uint32_t)AS_NUMBER(args[1]);               \
+    uint32_t left = AS_BITS(args[0]);                            \
+    uint32_t right = AS_BITS(args[1]);                           \
     RETURN_NUMBER(left op right);                                \
   }
 
@@ -455,11 +703,7 @@ DEF_NUM_FN(exp,    exp)
 
 DEF_NATIVE(number_mod) {
   if (!validateNumber(args[1], "Right operand")) return false;
-  double a = AS_NUMBER(args[0]);
-  double b = AS_NUMBER(args[1]);
-  double c = fmod(a, b);
-  if ((c < 0 && b >= 0) || (b < 0 && a >= 0)) c += b;
-  RETURN_NUMBER(c);
+  RETURN_NUMBER(numberModulo(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
 }
 
 DEF_NATIVE(number_equals) {
@@ -473,7 +717,7 @@ DEF_NATIVE(number_notEquals) {
 }
 
 DEF_NATIVE(number_bitwiseNot) {
-  RETURN_NUMBER(~(uint32_t)AS_NUMBER(args[0]));
+  RETURN_NUMBER(~AS_BITS(args[0]));
 }
 
 DEF_NATIVE(number_rangeDotDot) {
@@ -1237,7 +1481,7 @@ static ObjClass* defineClass(VM* vm, ObjModule* module, const char* name) {
   pushRoot((Obj*)className);
 
   ObjClass* cls = newSingleClass(className);
-  tableSet(&module->variables, className, OBJ_VAL(cls), true);
+  moduleDefineVariable(module, className, OBJ_VAL(cls), true);
 
   popRoot();
   return cls;
@@ -1246,7 +1490,7 @@ static ObjClass* defineClass(VM* vm, ObjModule* module, const char* name) {
 #define GET_CORE_CLASS(cls, name)                                     \
   do {                                                                \
     Value value;                                                      \
-    if (tableGet(&coreModule->variables, copyString(name), &value)) { \
+    if (moduleGetVariable(coreModule, copyString(name), &value)) {    \
       cls = AS_CLASS(value);                                          \
     } else {                                                          \
       ASSERT(false, "Class should already be defined");               \
@@ -1412,13 +1656,19 @@ void initializeCore(VM* vm) {
   NATIVE(vm->listClass, "add(1)", 1, list_add);
   NATIVE(vm->listClass, "addCore(1)", 1, list_addCore);
   NATIVE(vm->listClass, "clear()", 0, list_clear);
+  NATIVE(vm->listClass, "filter(1)", 1, list_filter);
+  NATIVE(vm->listClass, "forEach(1)", 1, list_forEach);
   NATIVE(vm->listClass, "indexOf(1)", 1, list_indexOf);
   NATIVE(vm->listClass, "insert(2)", 2, list_insert);
   NATIVE(vm->listClass, "iterate(1)", 1, list_iterate);
   NATIVE(vm->listClass, "iteratorValue(1)", 1, list_iteratorValue);
+  NATIVE(vm->listClass, "map(1)", 1, list_map);
+  NATIVE(vm->listClass, "reduce(2)", 2, list_reduce);
   NATIVE(vm->listClass, "removeAt(1)", 1, list_removeAt);
   NATIVE(vm->listClass, "remove(1)", 1, list_removeValue);
   NATIVE(vm->listClass, "size", 0, list_size);
+  NATIVE(vm->listClass, "sort(1)", 1, list_sort);
+  NATIVE(vm->listClass, "sortCore()", 0, list_sortCore);
   NATIVE(vm->listClass, "count", 0, list_size);
   NATIVE(vm->listClass, "swap(2)", 2, list_swap);
 
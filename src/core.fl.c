@@ -57,7 +57,7 @@ static const char* coreSource __attribute__((unused)) =
 "  forEach(function)\n"
 "    each element in this\n"
 "      function(element)\n"
-"  \n"
+"\n"
 "  sumOf(function) = this.reduce(0, fun acc, i = acc + function(i) )\n"
 "\n"
 "  maxOf(function)\n"
@@ -115,14 +115,14 @@ static const char* coreSource __attribute__((unused)) =
 "      result = result + item.toString()\n"
 "\n"
 "    return result\n"
-"  \n"
+"\n"
 "  joinToString(sep, function)\n"
 "    var result = \"\"\n"
 "\n"
 "    each item[index] in this\n"
 "      if index != 0 do result = result + sep\n"
 "      result = result + function(item).toString()\n"
-"    \n"
+"\n"
 "    return result\n"
 "\n"
 "  toList()\n"
@@ -311,43 +311,10 @@ static const char* coreSource __attribute__((unused)) =
 "    each element in other\n"
 "      this.add(element)\n"
 "\n"
-"  map(transformation)\n"
-"    val result = List()\n"
-"    each item in this\n"
-"      result.add(transformation(item))\n"
-"    return result\n"
-"\n"
-"  filter(predicate)\n"
-"    val result = List()\n"
-"    each item in this\n"
-"      if predicate(item) do result.add(item)\n"
-"    return result\n"
-"\n"
 "  sort()\n"
-"    this.sort( fun low, high = low <= high )\n"
-"\n"
-"  sort(comparer)\n"
-"    if comparer is not Function\n"
-"      error \"Comparer must be a function\"\n"
-"    this.quicksort(0, this.size - 1, comparer)\n"
-"\n"
-"  quicksort(low, high, comparer)\n"
-"    if low < high\n"
-"      val p = this.partition(low, high, comparer)\n"
-"      this.quicksort(low, p - 1, comparer)\n"
-"      this.quicksort(p + 1, high, comparer)\n"
-"  \n"
-"  sum() = this.reduce( fun acc, item = acc + item )\n"
+"    if not this.sortCore() do this.sort( fun low, high = low <= high )\n"
 "\n"
-"  partition(low, high, comparer)\n"
-"    val pivot = this[high]\n"
-"    var i = low - 1\n"
-"    each j in low..<high\n"
-"      if comparer(this[j], pivot)\n"
-"        i = i + 1\n"
-"        this.swap(i, j)\n"
-"    this.swap(i + 1, high)\n"
-"    return i + 1\n"
+"  sum() = this.reduce( fun acc, item = acc + item )\n"
 "\n"
 "  toString() = \"[=(this.joinToString())]\"\n"
 "\n"
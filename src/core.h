@@ -1,8 +1,24 @@
 #ifndef flicker_core_h
 #define flicker_core_h
 
+#include <math.h>
+
 #include "vm.h"
 
+// The result of the % operator, which always has the same sign as the divisor.
+static inline double numberModulo(double a, double b) {
+  double c = fmod(a, b);
+  if ((c < 0 && b >= 0) || (b < 0 && a >= 0)) c += b;
+  return c;
+}
+
+// The same as numberModulo, for ints.
+static inline int64_t intModulo(int64_t a, int64_t b) {
+  int64_t c = a % b;
+  if ((c < 0 && b >= 0) || (b < 0 && a >= 0)) c += b;
+  return c;
+}
+
 void initializeCore(VM* vm);
 
 #endif
\ No newline at end of file
@@ -22,6 +22,74 @@ void disassembleChunk(Chunk* chunk, const char* name) {
   }
 }
 
+#if DEBUG_INLINE_CACHE_STATS
+void printCacheStats(ObjFunction* function) {
+# if DEBUG_INLINE_CACHE_STATS == 1
+  if (function->module->isCore) return;
+# endif
+
+  for (int i = 0; i < function->chunk.cacheCount; i++) {
+    InlineCache* cache = &function->chunk.caches[i];
+    // Skip call sites that never got to look up a method.
+    if (cache->name == NULL) continue;
+
+    printf("%s:%d '%s' %u hits, %u misses, %u megamorphic (%s)\n", function->module->name->chars,
+           cache->line, cache->name->chars, cache->hits, cache->misses, cache->megamorphicCalls,
+           cache->megamorphic ? "megamorphic" : cache->count > 1 ? "polymorphic" : "monomorphic");
+  }
+}
+#endif
+
+#if DEBUG_COUNT_OPCODE_PAIRS
+#define OPCODE_PAIRS_SHOWN 40
+
+static const char* opcodeNames[] = {
+# define OPCODE(name) #name,
+# include "opcodes.h"
+# undef OPCODE
+};
+
+void printOpcodePairs(uint64_t pairs[UINT8_COUNT][UINT8_COUNT]) {
+  uint64_t total = 0;
+  for (int first = 0; first < UINT8_COUNT; first++) {
+    for (int second = 0; second < UINT8_COUNT; second++) {
+      total += pairs[first][second];
+    }
+  }
+
+  if (total == 0) return;
+
+  printf("== opcode pairs (%llu total) ==\n", (unsigned long long)total);
+
+  // Find the most common pair that hasn't been printed, until enough have.
+  uint64_t previous = UINT64_MAX;
+  int shown = 0;
+  while (shown < OPCODE_PAIRS_SHOWN) {
+    uint64_t most = 0;
+    for (int first = 0; first < UINT8_COUNT; first++) {
+      for (int second = 0; second < UINT8_COUNT; second++) {
+        uint64_t count = pairs[first][second];
+        if (count > most && count < previous) most = count;
+      }
+    }
+
+    if (most == 0) break;
+
+    for (int first = 0; first < UINT8_COUNT && shown < OPCODE_PAIRS_SHOWN; first++) {
+      for (int second = 0; second < UINT8_COUNT && shown < OPCODE_PAIRS_SHOWN; second++) {
+        if (pairs[first][second] != most) continue;
+
+        printf("%12llu %5.2f%%  %-16s %s\n", (unsigned long long)most, 100.0 * most / total,
+               opcodeNames[first], opcodeNames[second]);
+        shown++;
+      }
+    }
+
+    previous = most;
+  }
+}
+#endif
+
 static int variableConstant(Chunk* chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   if (constant >= 0x80) {
@@ -39,14 +107,46 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + (constant >= 0x80 ? 3 : 2);
 }
 
-static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+  int slot = variableConstant(chunk, offset);
+  printf("%-16s %4d\n", name, slot);
+  return offset + (slot >= 0x80 ? 3 : 2);
+}
+
+static int cachedInstruction(const char* name, int argCount, Chunk* chunk, int offset) {
   int constant = variableConstant(chunk, offset);
-  uint8_t argCount;
-  if (name[3] == 'S') {
-    argCount = chunk->code[offset] - OP_SUPER_0;
-  } else {
-    argCount = chunk->code[offset] - OP_INVOKE_0;
+  int next = offset + (constant >= 0x80 ? 3 : 2);
+  int cache = variableConstant(chunk, next - 1);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'  (%d args, cache %d)\n", argCount, cache);
+  return next + (cache >= 0x80 ? 2 : 1);
+}
+
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+  int constant = variableConstant(chunk, offset);
+  int next = offset + (constant >= 0x80 ? 3 : 2);
+  int cache = variableConstant(chunk, next - 1);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'  (cache %d)\n", cache);
+  return next + (cache >= 0x80 ? 2 : 1);
+}
+
+// A quickened invoke keeps its argument count in the inline cache.
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset) {
+  int constant = variableConstant(chunk, offset);
+  int cache = variableConstant(chunk, offset + (constant >= 0x80 ? 3 : 2) - 1);
+  return cachedInstruction(name, chunk->caches[cache].argCount, chunk, offset);
+}
+
+static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
+  if (name[0] != 'S') {
+    return cachedInstruction(name, chunk->code[offset] - OP_INVOKE_0, chunk, offset);
   }
+
+  int constant = variableConstant(chunk, offset);
+  uint8_t argCount = chunk->code[offset] - OP_SUPER_0;
   printf("%-16s %4d '", name, constant);
   printValue(chunk->constants.values[constant]);
   printf("'  (%d args)\n", argCount);
@@ -71,6 +171,21 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
   return offset + 3;
 }
 
+static int iterateInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint16_t test = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+  uint16_t body = (uint16_t)((chunk->code[offset + 4] << 8) | chunk->code[offset + 5]);
+  printf("%-16s %4d -> %d, %d\n", name, slot, offset + 4 + test, offset + 6 + body);
+  return offset + 6;
+}
+
+static int byteJumpInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t byte = chunk->code[offset + 1];
+  uint16_t jump = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+  printf("%-16s %4d -> %d\n", name, byte, offset + 4 + jump);
+  return offset + 4;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
   if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
@@ -98,21 +213,21 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SET_LOCAL:
       return byteInstruction("SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("GET_GLOBAL", chunk, offset);
+      return globalInstruction("GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("DEFINE_GLOBAL", chunk, offset);
+      return globalInstruction("DEFINE_GLOBAL", chunk, offset);
     case OP_DEFINE_IMMUTABLE_GLOBAL:
-      return constantInstruction("DEFINE_IMMUTABLE_GLOBAL", chunk, offset);
+      return globalInstruction("DEFINE_IMMUTABLE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("SET_GLOBAL", chunk, offset);
+      return globalInstruction("SET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
       return byteInstruction("SET_UPVALUE", chunk, offset);
     case OP_GET_PROPERTY:
-      return constantInstruction("GET_PROPERTY", chunk, offset);
+      return propertyInstruction("GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("SET_PROPERTY", chunk, offset);
+      return propertyInstruction("SET_PROPERTY", chunk, offset);
     case OP_BIND_METHOD:
       return constantInstruction("BIND_METHOD", chunk, offset);
     case OP_BIND_SUPER:
@@ -131,6 +246,12 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return jumpInstruction("JUMP_TRUTHY_POP", 1, chunk, offset);
     case OP_LOOP:
       return jumpInstruction("LOOP", -1, chunk, offset);
+    case OP_ITER_NEXT:
+      return iterateInstruction("ITER_NEXT", chunk, offset);
+    case OP_RANGE_START:
+      return iterateInstruction("RANGE_START", chunk, offset);
+    case OP_RANGE_NEXT:
+      return iterateInstruction("RANGE_NEXT", chunk, offset) + 1;
     // Just so you know, I didn't type this next section by hand.
     case OP_CALL_0:
       return simpleInstruction("CALL_0", offset);
@@ -234,6 +355,38 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return invokeInstruction("SUPER_15", chunk, offset);
     case OP_SUPER_16:
       return invokeInstruction("SUPER_16", chunk, offset);
+    case OP_ADD:
+      return cachedInstruction("ADD", 1, chunk, offset);
+    case OP_SUBTRACT:
+      return cachedInstruction("SUBTRACT", 1, chunk, offset);
+    case OP_MULTIPLY:
+      return cachedInstruction("MULTIPLY", 1, chunk, offset);
+    case OP_DIVIDE:
+      return cachedInstruction("DIVIDE", 1, chunk, offset);
+    case OP_MODULO:
+      return cachedInstruction("MODULO", 1, chunk, offset);
+    case OP_LESS:
+      return cachedInstruction("LESS", 1, chunk, offset);
+    case OP_GREATER:
+      return cachedInstruction("GREATER", 1, chunk, offset);
+    case OP_LESS_EQUAL:
+      return cachedInstruction("LESS_EQUAL", 1, chunk, offset);
+    case OP_GREATER_EQUAL:
+      return cachedInstruction("GREATER_EQUAL", 1, chunk, offset);
+    case OP_EQUAL:
+      return cachedInstruction("EQUAL", 1, chunk, offset);
+    case OP_NOT_EQUAL:
+      return cachedInstruction("NOT_EQUAL", 1, chunk, offset);
+    case OP_NEGATE:
+      return cachedInstruction("NEGATE", 0, chunk, offset);
+    case OP_NOT:
+      return cachedInstruction("NOT", 0, chunk, offset);
+    case OP_GET_SUBSCRIPT:
+      return cachedInstruction("GET_SUBSCRIPT", 1, chunk, offset);
+    case OP_SET_SUBSCRIPT:
+      return cachedInstruction("SET_SUBSCRIPT", 2, chunk, offset);
+    case OP_SLICE:
+      return byteJumpInstruction("SLICE", chunk, offset);
     case OP_IMPORT_MODULE:
       return constantInstruction("IMPORT_MODULE", chunk, offset);
     case OP_IMPORT_VARIABLE:
@@ -244,6 +397,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("END_MODULE", offset);
     case OP_TUPLE:
       return byteInstruction("TUPLE", chunk, offset);
+    case OP_UNPACK:
+      return byteJumpInstruction("UNPACK", chunk, offset);
     case OP_CLOSURE: {
       int constant = variableConstant(chunk, offset);
       offset += constant >= 0x80 ? 3 : 2;
@@ -273,6 +428,96 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return constantInstruction("METHOD_INSTANCE", chunk, offset);
     case OP_METHOD_STATIC:
       return constantInstruction("METHOD_STATIC", chunk, offset);
+    case OP_GET_FIELD:
+      return propertyInstruction("GET_FIELD", chunk, offset);
+    case OP_SET_FIELD:
+      return propertyInstruction("SET_FIELD", chunk, offset);
+    case OP_INVOKE_CACHED:
+      return cachedInvokeInstruction("INVOKE_CACHED", chunk, offset);
+    case OP_GET_LOCAL_GET_LOCAL:
+      return byteInstruction("GET_LOCAL_GET_LOCAL", chunk, offset);
+    case OP_GET_LOCAL_CONSTANT:
+      return byteInstruction("GET_LOCAL_CONSTANT", chunk, offset);
+    case OP_SET_LOCAL_POP:
+      return byteInstruction("SET_LOCAL_POP", chunk, offset);
+    case OP_SET_GLOBAL_POP:
+      return globalInstruction("SET_GLOBAL_POP", chunk, offset);
+    case OP_JUMP_FALSY_POP:
+      return jumpInstruction("JUMP_FALSY_POP", 1, chunk, offset);
+    case OP_POP_LOOP:
+      return simpleInstruction("POP_LOOP", offset);
+    case OP_BINARY_LOCAL_LOCAL:
+      return byteInstruction("BINARY_LOCAL_LOCAL", chunk, offset);
+    case OP_BINARY_LOCAL_CONSTANT:
+      return byteInstruction("BINARY_LOCAL_CONSTANT", chunk, offset);
+    case OP_TAIL_CALL_0:
+      return simpleInstruction("TAIL_CALL_0", offset);
+    case OP_TAIL_CALL_1:
+      return simpleInstruction("TAIL_CALL_1", offset);
+    case OP_TAIL_CALL_2:
+      return simpleInstruction("TAIL_CALL_2", offset);
+    case OP_TAIL_CALL_3:
+      return simpleInstruction("TAIL_CALL_3", offset);
+    case OP_TAIL_CALL_4:
+      return simpleInstruction("TAIL_CALL_4", offset);
+    case OP_TAIL_CALL_5:
+      return simpleInstruction("TAIL_CALL_5", offset);
+    case OP_TAIL_CALL_6:
+      return simpleInstruction("TAIL_CALL_6", offset);
+    case OP_TAIL_CALL_7:
+      return simpleInstruction("TAIL_CALL_7", offset);
+    case OP_TAIL_CALL_8:
+      return simpleInstruction("TAIL_CALL_8", offset);
+    case OP_TAIL_CALL_9:
+      return simpleInstruction("TAIL_CALL_9", offset);
+    case OP_TAIL_CALL_10:
+      return simpleInstruction("TAIL_CALL_10", offset);
+    case OP_TAIL_CALL_11:
+      return simpleInstruction("TAIL_CALL_11", offset);
+    case OP_TAIL_CALL_12:
+      return simpleInstruction("TAIL_CALL_12", offset);
+    case OP_TAIL_CALL_13:
+      return simpleInstruction("TAIL_CALL_13", offset);
+    case OP_TAIL_CALL_14:
+      return simpleInstruction("TAIL_CALL_14", offset);
+    case OP_TAIL_CALL_15:
+      return simpleInstruction("TAIL_CALL_15", offset);
+    case OP_TAIL_CALL_16:
+      return simpleInstruction("TAIL_CALL_16", offset);
+    case OP_TAIL_INVOKE_0:
+      return cachedInstruction("TAIL_INVOKE_0", 0, chunk, offset);
+    case OP_TAIL_INVOKE_1:
+      return cachedInstruction("TAIL_INVOKE_1", 1, chunk, offset);
+    case OP_TAIL_INVOKE_2:
+      return cachedInstruction("TAIL_INVOKE_2", 2, chunk, offset);
+    case OP_TAIL_INVOKE_3:
+      return cachedInstruction("TAIL_INVOKE_3", 3, chunk, offset);
+    case OP_TAIL_INVOKE_4:
+      return cachedInstruction("TAIL_INVOKE_4", 4, chunk, offset);
+    case OP_TAIL_INVOKE_5:
+      return cachedInstruction("TAIL_INVOKE_5", 5, chunk, offset);
+    case OP_TAIL_INVOKE_6:
+      return cachedInstruction("TAIL_INVOKE_6", 6, chunk, offset);
+    case OP_TAIL_INVOKE_7:
+      return cachedInstruction("TAIL_INVOKE_7", 7, chunk, offset);
+    case OP_TAIL_INVOKE_8:
+      return cachedInstruction("TAIL_INVOKE_8", 8, chunk, offset);
+    case OP_TAIL_INVOKE_9:
+      return cachedInstruction("TAIL_INVOKE_9", 9, chunk, offset);
+    case OP_TAIL_INVOKE_10:
+      return cachedInstruction("TAIL_INVOKE_10", 10, chunk, offset);
+    case OP_TAIL_INVOKE_11:
+      return cachedInstruction("TAIL_INVOKE_11", 11, chunk, offset);
+    case OP_TAIL_INVOKE_12:
+      return cachedInstruction("TAIL_INVOKE_12", 12, chunk, offset);
+    case OP_TAIL_INVOKE_13:
+      return cachedInstruction("TAIL_INVOKE_13", 13, chunk, offset);
+    case OP_TAIL_INVOKE_14:
+      return cachedInstruction("TAIL_INVOKE_14", 14, chunk, offset);
+    case OP_TAIL_INVOKE_15:
+      return cachedInstruction("TAIL_INVOKE_15", 15, chunk, offset);
+    case OP_TAIL_INVOKE_16:
+      return cachedInstruction("TAIL_INVOKE_16", 16, chunk, offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
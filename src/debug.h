@@ -8,4 +8,12 @@ void printStack(VM* vm);
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
+#if DEBUG_INLINE_CACHE_STATS
+void printCacheStats(ObjFunction* function);
+#endif
+
+#if DEBUG_COUNT_OPCODE_PAIRS
+void printOpcodePairs(uint64_t pairs[UINT8_COUNT][UINT8_COUNT]);
+#endif
+
 #endif
@@ -313,7 +313,7 @@ static Token makeNumber(bool isHex) {
   Token token = makeToken(TOKEN_NUMBER);
 
   if (isHex) {
-    token.value = NUMBER_VAL((double)strtoll(lexer.start, NULL, 16));
+    token.value = numberToValue((double)strtoll(lexer.start, NULL, 16));
   } else {
     size_t len = lexer.current - lexer.start + 1;
     char* copy = ALLOCATE(char, len);
@@ -328,7 +328,7 @@ static Token makeNumber(bool isHex) {
 
     *write = '\0';
 
-    token.value = NUMBER_VAL(strtod(copy, NULL));
+    token.value = numberToValue(strtod(copy, NULL));
     FREE_ARRAY(char, copy, len);
   }
 
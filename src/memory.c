@@ -5,7 +5,7 @@
 #include "compiler.h"
 #include "vm.h"
 
-#if DEBUG_LOG_GC
+#if DEBUG_LOG_GC || DEBUG_INLINE_CACHE_STATS
 #include <stdio.h>
 
 #include "debug.h"
@@ -90,7 +90,9 @@ static void blackenObject(Obj* object) {
       markObject((Obj*)cls->superclass);
 
       markObject((Obj*)cls->name);
-      markTable(&cls->methods);
+      for (int i = 0; i < cls->methodCount; i++) {
+        markValue(cls->methods[i]);
+      }
       break;
     }
     case OBJ_CLOSURE: {
@@ -106,12 +108,18 @@ static void blackenObject(Obj* object) {
       markObject((Obj*)function->name);
       markObject((Obj*)function->module);
       markArray(&function->chunk.constants);
+      for (int i = 0; i < function->chunk.cacheCount; i++) {
+        markObject((Obj*)function->chunk.caches[i].field);
+      }
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       markObject((Obj*)instance->obj.cls);
-      markTable(&instance->fields);
+      markObject((Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(instance->fields[i]);
+      }
       break;
     }
     case OBJ_LIST: {
@@ -129,9 +137,20 @@ static void blackenObject(Obj* object) {
     case OBJ_MODULE: {
       ObjModule* module = (ObjModule*)object;
       markTable(&module->variables);
+      for (int i = 0; i < module->slotCount; i++) {
+        markObject((Obj*)module->slots[i].name);
+        markValue(module->slots[i].value);
+      }
       markObject((Obj*)module->name);
       break;
     }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markObject((Obj*)shape->parent);
+      markObject((Obj*)shape->name);
+      markTable(&shape->transitions);
+      break;
+    }
     case OBJ_TUPLE: {
       ObjTuple* tuple = (ObjTuple*)object;
       // If the tuple is being initialized, it won't have any items, so we break.
@@ -163,7 +182,7 @@ static void freeObject(Obj* object) {
       break;
     case OBJ_CLASS: {
       ObjClass* cls = (ObjClass*)object;
-      freeTable(&cls->methods);
+      FREE_ARRAY(Value, cls->methods, cls->methodCount);
       // Do I need to free the initializer? (it's a value)
       FREE(ObjClass, object);
       break;
@@ -182,8 +201,10 @@ static void freeObject(Obj* object) {
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
-      freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+      }
+      reallocate(object, sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity, 0);
       break;
     }
     case OBJ_LIST: {
@@ -199,7 +220,9 @@ static void freeObject(Obj* object) {
       break;
     }
     case OBJ_MODULE: {
-      freeTable(&((ObjModule*)object)->variables);
+      ObjModule* module = (ObjModule*)object;
+      freeTable(&module->variables);
+      FREE_ARRAY(ModuleVariable, module->slots, module->slotCapacity);
       break;
     }
     case OBJ_NATIVE:
@@ -211,6 +234,10 @@ static void freeObject(Obj* object) {
     case OBJ_RANGE:
       FREE(ObjRange, object);
       break;
+    case OBJ_SHAPE:
+      freeTable(&((ObjShape*)object)->transitions);
+      FREE(ObjShape, object);
+      break;
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
       FREE_ARRAY(char, string->chars, string->length + 1);
@@ -249,7 +276,12 @@ static void markRoots() {
   markTable(&vm.modules);
   markCompilerRoots();
   markObject((Obj*)vm.initString);
+  for (int arity = 0; arity <= MAX_PARAMETERS; arity++) {
+    markObject((Obj*)vm.initSignatures[arity]);
+  }
   markObject((Obj*)vm.coreString);
+  markObject((Obj*)vm.emptyShape);
+  markArray(&vm.methodNames);
 }
 
 static void traceReferences() {
@@ -259,7 +291,23 @@ static void traceReferences() {
   }
 }
 
+#if DEBUG_INLINE_CACHE_STATS
+// This runs before anything is freed, because the stats refer to the names of
+// methods and modules that might be getting freed along with the function.
+static void printAllCacheStats(bool onlyUnmarked) {
+  for (Obj* object = vm.objects; object != NULL; object = object->next) {
+    if (object->type == OBJ_FUNCTION && !(onlyUnmarked && object->isMarked)) {
+      printCacheStats((ObjFunction*)object);
+    }
+  }
+}
+#endif
+
 static void sweep() {
+# if DEBUG_INLINE_CACHE_STATS
+  printAllCacheStats(true);
+# endif
+
   Obj* previous = NULL;
   Obj* object = vm.objects;
   while (object != NULL) {
@@ -302,6 +350,10 @@ void collectGarbage() {
 }
 
 void freeObjects() {
+# if DEBUG_INLINE_CACHE_STATS
+  printAllCacheStats(false);
+# endif
+
   Obj* object = vm.objects;
   while (object != NULL) {
     Obj* next = object->next;
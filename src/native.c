@@ -3,6 +3,12 @@
 #include <math.h>
 #include <stdlib.h>
 
+void defineNative(ObjClass* cls, const char* name, ObjNative* native) {
+  pushRoot((Obj*)native);
+  classDefineMethod(cls, copyString(name), OBJ_VAL(native));
+  popRoot();
+}
+
 static uint32_t validateIndexValue(uint32_t count, double value, const char* argName) {
   if (!validateIntValue(value, argName)) return UINT32_MAX;
 
@@ -25,11 +31,18 @@ bool validateIntValue(double value, const char* argName) {
 }
 
 bool validateInt(Value arg, const char* argName) {
+  if (IS_INT(arg)) return true;
   if (!validateNumber(arg, argName)) return false;
   return validateIntValue(AS_NUMBER(arg), argName);
 }
 
 uint32_t validateIndex(Value arg, uint32_t count, const char* argName) {
+  if (IS_INT(arg)) {
+    int64_t index = AS_INT(arg);
+    if (index < 0) index += count;
+    if (0 <= index && index < count) return (uint32_t)index;
+  }
+
   if (!validateNumber(arg, argName)) return UINT32_MAX;
   return validateIndexValue(count, AS_NUMBER(arg), argName);
 }
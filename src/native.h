@@ -7,7 +7,7 @@
 #include "vm.h"
 
 #define NATIVE(cls, name, arity, function) \
-  tableSet(&cls->methods, copyString(name), OBJ_VAL(newNative(native_##function, arity)), true)
+  defineNative(cls, name, newNative(native_##function, arity))
 
 #define DEF_NATIVE(name) static bool native_##name(Value* args)
 
@@ -18,7 +18,7 @@
   } while (false)
 
 #define RETURN_OBJ(obj)     RETURN_VAL(OBJ_VAL(obj))
-#define RETURN_NUMBER(num)  RETURN_VAL(NUMBER_VAL(num))
+#define RETURN_NUMBER(num)  RETURN_VAL(numberToValue(num))
 #define RETURN_BOOL(value)  RETURN_VAL(BOOL_VAL(value))
 #define RETURN_NONE()       RETURN_VAL(NONE_VAL)
 #define RETURN_TRUE()       RETURN_VAL(TRUE_VAL)
@@ -26,12 +26,25 @@
 
 #define ERROR(...) runtimeError(__VA_ARGS__)
 
+// Calls [callee] with the [argCount] values in [argv] and puts what it returns
+// in [result], or returns from the native if that raised an error. The stack
+// can grow while the call runs, which moves it, so [args] is pointed at the
+// native's arguments again afterwards.
+#define CALL_VALUE(callee, argCount, argv, result)                   \
+  do {                                                              \
+    ptrdiff_t argsOffset = args - vm.stack;                         \
+    if (!vmCallValue(callee, argCount, argv, result)) return false; \
+    args = vm.stack + argsOffset;                                   \
+  } while (false)
+
 #define RETURN_ERROR(...) \
   do {                           \
     runtimeError(__VA_ARGS__);   \
     return false;                \
   } while (false)
 
+void defineNative(ObjClass* cls, const char* name, ObjNative* native);
+
 bool validateNumber(Value arg, const char* argName);
 
 bool validateIntValue(double value, const char* argName);
@@ -51,7 +51,13 @@ ObjClass* newSingleClass(ObjString* name) {
   ObjClass* cls = ALLOCATE_OBJ(ObjClass, OBJ_CLASS, NULL);
   cls->name = name;
   cls->superclass = NULL;
-  initTable(&cls->methods);
+  cls->methods = NULL;
+  cls->methodCount = 0;
+  cls->instanceFields = 0;
+
+  // The address of this class might have belonged to a class that was freed,
+  // so any inline caches pointing to it need to be invalidated.
+  vm.methodEpoch++;
   return cls;
 }
 
@@ -78,10 +84,52 @@ ObjClass* newClass(ObjString* name) {
   return cls;
 }
 
+// Makes room in the method array of [cls] for at least [count] symbols.
+static void growMethods(ObjClass* cls, int count) {
+  if (cls->methodCount >= count) return;
+
+  // Leave room for every symbol there is so far, since classes tend to get
+  // more methods soon after their first one.
+  if (count < vm.methodNames.count) count = vm.methodNames.count;
+
+  cls->methods = GROW_ARRAY(Value, cls->methods, cls->methodCount, count);
+  for (int i = cls->methodCount; i < count; i++) {
+    cls->methods[i] = UNDEFINED_VAL;
+  }
+  cls->methodCount = count;
+}
+
 void bindSuperclass(ObjClass* subclass, ObjClass* superclass) {
   ASSERT(superclass != NULL, "Must have superclass");
   subclass->superclass = superclass;
-  tableAddAll(&superclass->methods, &subclass->methods, true);
+  growMethods(subclass, superclass->methodCount);
+
+  for (int i = 0; i < superclass->methodCount; i++) {
+    if (!IS_UNDEFINED(superclass->methods[i])) subclass->methods[i] = superclass->methods[i];
+  }
+
+  vm.methodEpoch++;
+}
+
+int methodSymbol(ObjString* name) {
+  if (name->symbol < 0) {
+    push(OBJ_VAL(name));
+    writeValueArray(&vm.methodNames, OBJ_VAL(name));
+    pop();
+    name->symbol = vm.methodNames.count - 1;
+  }
+
+  return name->symbol;
+}
+
+void classDefineMethod(ObjClass* cls, ObjString* name, Value method) {
+  push(method);
+  int symbol = methodSymbol(name);
+  growMethods(cls, symbol + 1);
+  pop();
+
+  cls->methods[symbol] = method;
+  vm.methodEpoch++;
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
@@ -101,18 +149,84 @@ ObjFunction* newFunction(ObjModule* module) {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION, vm.functionClass);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
+  function->callCount = 0;
   function->name = NULL;
   function->module = module;
   initChunk(&function->chunk);
   return function;
 }
 
+ObjShape* newShape(ObjShape* parent, ObjString* name) {
+  ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE, NULL);
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  initTable(&shape->transitions);
+  return shape;
+}
+
+int shapeFieldSlot(ObjShape* shape, ObjString* name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name) return shape->fieldCount - 1;
+  }
+
+  return -1;
+}
+
+static ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+  ObjShape* child = newShape(shape, name);
+  pushRoot((Obj*)child);
+  tableSet(&shape->transitions, name, OBJ_VAL(child), true);
+  popRoot();
+  return child;
+}
+
 ObjInstance* newInstance(ObjClass* cls) {
-  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE, cls);
-  initTable(&instance->fields);
+  int capacity = cls->instanceFields;
+  ObjInstance* instance = (ObjInstance*)allocateObject(sizeof(ObjInstance) + sizeof(Value) * capacity,
+                                                       OBJ_INSTANCE, cls);
+  instance->shape = vm.emptyShape;
+  instance->capacity = capacity;
+  instance->fields = instance->inlineFields;
+  instance->inlineCapacity = capacity;
   return instance;
 }
 
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value) {
+  int slot = shapeFieldSlot(instance->shape, name);
+  if (slot >= 0) {
+    instance->fields[slot] = value;
+    return;
+  }
+
+  instanceAddField(instance, shapeTransition(instance->shape, name), value);
+}
+
+void instanceAddField(ObjInstance* instance, ObjShape* shape, Value value) {
+  if (instance->capacity < shape->fieldCount) {
+    int capacity = GROW_CAPACITY(instance->capacity);
+    Value* fields = ALLOCATE(Value, capacity);
+    memcpy(fields, instance->fields, sizeof(Value) * instance->shape->fieldCount);
+
+    if (instance->fields != instance->inlineFields) {
+      FREE_ARRAY(Value, instance->fields, instance->capacity);
+    }
+
+    instance->fields = fields;
+    instance->capacity = capacity;
+  }
+
+  instance->fields[shape->fieldCount - 1] = value;
+  instance->shape = shape;
+
+  ObjClass* cls = instance->obj.cls;
+  if (cls->instanceFields < shape->fieldCount) cls->instanceFields = shape->fieldCount;
+}
+
 ObjList* newList(uint32_t count) {
   Value* array = NULL;
   if (count > 0) array = ALLOCATE(Value, count);
@@ -212,12 +326,57 @@ ObjModule* newModule(ObjString* name, bool isCore) {
   pushRoot((Obj*)module);
   
   initTable(&module->variables);
+  module->slots = NULL;
+  module->slotCount = 0;
+  module->slotCapacity = 0;
   module->name = name;
   module->isCore = isCore;
   popRoot();
   return module;
 }
 
+// Finds the slot of the variable [name] in [module], adding an undefined one
+// if it doesn't have a slot yet.
+int moduleVariableSlot(ObjModule* module, ObjString* name) {
+  Value slot;
+  if (tableGet(&module->variables, name, &slot)) return (int)AS_NUMBER(slot);
+
+  pushRoot((Obj*)name);
+
+  if (module->slotCapacity < module->slotCount + 1) {
+    int oldCapacity = module->slotCapacity;
+    module->slotCapacity = GROW_CAPACITY(oldCapacity);
+    module->slots = GROW_ARRAY(ModuleVariable, module->slots, oldCapacity, module->slotCapacity);
+  }
+
+  ModuleVariable* variable = &module->slots[module->slotCount++];
+  variable->name = name;
+  variable->value = UNDEFINED_VAL;
+  variable->isMutable = true;
+  tableSet(&module->variables, name, NUMBER_VAL(module->slotCount - 1), true);
+
+  popRoot();
+  return module->slotCount - 1;
+}
+
+void moduleDefineVariable(ObjModule* module, ObjString* name, Value value, bool isMutable) {
+  push(value);
+  int slot = moduleVariableSlot(module, name);
+  pop();
+
+  ModuleVariable* variable = &module->slots[slot];
+  variable->value = value;
+  variable->isMutable = isMutable;
+}
+
+bool moduleGetVariable(ObjModule* module, ObjString* name, Value* value) {
+  Value slot;
+  if (!tableGet(&module->variables, name, &slot)) return false;
+
+  *value = module->slots[(int)AS_NUMBER(slot)].value;
+  return !IS_UNDEFINED(*value);
+}
+
 ObjNative* newNative(NativeFn function, int arity) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE, NULL);
   native->function = function;
@@ -250,6 +409,7 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
   string->length = length;
   string->chars = chars;
   string->hash = hash;
+  string->symbol = -1;
 
   push(OBJ_VAL(string));
   tableSet(&vm.strings, string, NONE_VAL, true);
@@ -565,6 +725,9 @@ void printObject(Value value) {
       printValue(NUMBER_VAL(range->to));
       break;
     }
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
@@ -20,6 +20,7 @@
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 #define IS_PRNG(value)         isObjType(value, OBJ_PRNG)
 #define IS_RANGE(value)        isObjType(value, OBJ_RANGE)
+#define IS_SHAPE(value)        isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 #define IS_TUPLE(value)        isObjType(value, OBJ_TUPLE)
 
@@ -34,6 +35,7 @@
 #define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
 #define AS_PRNG(value)         ((ObjPrng*)AS_OBJ(value))
 #define AS_RANGE(value)        ((ObjRange*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 #define AS_TUPLE(value)        ((ObjTuple*)AS_OBJ(value))
@@ -50,6 +52,7 @@ typedef enum {
   OBJ_NATIVE,
   OBJ_PRNG,
   OBJ_RANGE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_TUPLE,
   OBJ_UPVALUE
@@ -64,9 +67,22 @@ struct Obj {
   struct Obj* next;
 };
 
+typedef struct {
+  ObjString* name;
+  // UNDEFINED_VAL until the variable is defined, since code can refer to it
+  // before that.
+  Value value;
+  bool isMutable;
+} ModuleVariable;
+
 typedef struct {
   Obj obj;
+  // Maps the name of each variable to the index of its slot, which is what
+  // the instructions for module variables refer to.
   Table variables;
+  ModuleVariable* slots;
+  int slotCount;
+  int slotCapacity;
   ObjString* name;
   bool isCore;
 } ObjModule;
@@ -75,6 +91,12 @@ typedef struct {
   Obj obj;
   uint8_t arity;
   int upvalueCount;
+  // The most stack slots the function uses at once, counting the function
+  // itself and its arguments.
+  int maxSlots;
+  // How many times the function has been called, until it's hot enough to be
+  // optimized. It stays at HOT_FUNCTION_CALLS after that.
+  int callCount;
   Chunk chunk;
   ObjString* name;
   ObjModule* module;
@@ -112,6 +134,9 @@ struct ObjString {
   int length;
   char* chars;
   uint32_t hash;
+  // The index of this string in every class's method array if it's the
+  // signature of a method, or -1 if no method with it was ever defined.
+  int symbol;
 };
 
 typedef struct {
@@ -146,12 +171,37 @@ struct ObjClass {
   Obj obj;
   ObjClass* superclass;
   ObjString* name;
-  Table methods;
+  // The methods of this class, indexed by the symbol of their signature. Any
+  // symbol the class doesn't have a method for is UNDEFINED_VAL.
+  Value* methods;
+  int methodCount;
+  // The most fields any instance of this class has had, so new instances can
+  // be allocated with room for all of them.
+  int instanceFields;
 };
 
+// A shape describes which fields an instance has, and which slot each of them
+// is stored in. Instances that had the same fields added in the same order
+// share a shape. Every shape adds one field to its parent, and the shapes
+// for adding another field are found in its transitions.
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape* parent;
+  // The field this shape adds, which is stored in slot [fieldCount - 1].
+  ObjString* name;
+  int fieldCount;
+  Table transitions;
+} ObjShape;
+
 typedef struct {
   Obj obj;
-  Table fields;
+  ObjShape* shape;
+  int capacity;
+  // Points to inlineFields until the instance gets more fields than it was
+  // allocated with, and then to a separate array.
+  Value* fields;
+  int inlineCapacity;
+  Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -170,12 +220,37 @@ ObjBoundMethod* newBoundNative(Value receiver, ObjNative* method);
 ObjClass* newSingleClass(ObjString* name);
 ObjClass* newClass(ObjString* name);
 void bindSuperclass(ObjClass* subclass, ObjClass* superclass);
+int methodSymbol(ObjString* name);
+void classDefineMethod(ObjClass* cls, ObjString* name, Value method);
+
+static inline bool classFindMethod(ObjClass* cls, ObjString* name, Value* method) {
+  // Names that never got a symbol are -1, which is out of range too.
+  if ((unsigned)name->symbol >= (unsigned)cls->methodCount) return false;
+
+  *method = cls->methods[name->symbol];
+  return !IS_UNDEFINED(*method);
+}
 
 ObjClosure* newClosure(ObjFunction* function);
 
 ObjFunction* newFunction(ObjModule* module);
 
+ObjShape* newShape(ObjShape* parent, ObjString* name);
+int shapeFieldSlot(ObjShape* shape, ObjString* name);
+
 ObjInstance* newInstance(ObjClass* cls);
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+// Adds a field to [instance], where [shape] is the transition from its current
+// shape that adds the field.
+void instanceAddField(ObjInstance* instance, ObjShape* shape, Value value);
+
+static inline bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+  int slot = shapeFieldSlot(instance->shape, name);
+  if (slot < 0) return false;
+
+  *value = instance->fields[slot];
+  return true;
+}
 
 ObjList* newList(uint32_t count);
 void listClear(ObjList* list);
@@ -191,6 +266,9 @@ void mapClear(ObjMap* map);
 void mapRemoveKey(ObjMap* map, Value key);
 
 ObjModule* newModule(ObjString* name, bool isCore);
+int moduleVariableSlot(ObjModule* module, ObjString* name);
+void moduleDefineVariable(ObjModule* module, ObjString* name, Value value, bool isMutable);
+bool moduleGetVariable(ObjModule* module, ObjString* name, Value* value);
 
 ObjNative* newNative(NativeFn function, int arity);
 
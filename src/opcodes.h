@@ -0,0 +1,199 @@
+// The bytecode instructions, written as an X macro so that the OpCode enum in
+// chunk.h and the dispatch table in the VM are always generated from the same
+// list. Anything that includes this file has to define OPCODE(name) first.
+//
+// The numbered groups (CALL, INVOKE, SUPER, TAIL_CALL, TAIL_INVOKE) need to
+// stay in order, because the VM gets the argument count by subtracting the
+// first opcode of the group. The binary operators from ADD to NOT_EQUAL also
+// need to stay together.
+
+OPCODE(CONSTANT)
+OPCODE(NONE)
+OPCODE(TRUE)
+OPCODE(FALSE)
+
+OPCODE(POP)
+OPCODE(DUP)
+
+OPCODE(GET_LOCAL)
+OPCODE(SET_LOCAL)
+OPCODE(GET_GLOBAL)
+OPCODE(DEFINE_GLOBAL)
+OPCODE(DEFINE_IMMUTABLE_GLOBAL)
+OPCODE(SET_GLOBAL)
+OPCODE(GET_UPVALUE)
+OPCODE(SET_UPVALUE)
+OPCODE(GET_PROPERTY)
+OPCODE(SET_PROPERTY)
+
+OPCODE(BIND_METHOD)
+OPCODE(BIND_SUPER)
+
+OPCODE(PRINT)
+OPCODE(ERROR)
+OPCODE(JUMP)
+OPCODE(JUMP_FALSY)
+OPCODE(JUMP_TRUTHY)
+OPCODE(JUMP_TRUTHY_POP)
+OPCODE(LOOP)
+OPCODE(ITER_NEXT)
+OPCODE(RANGE_START)
+OPCODE(RANGE_NEXT)
+
+OPCODE(CALL_0)
+OPCODE(CALL_1)
+OPCODE(CALL_2)
+OPCODE(CALL_3)
+OPCODE(CALL_4)
+OPCODE(CALL_5)
+OPCODE(CALL_6)
+OPCODE(CALL_7)
+OPCODE(CALL_8)
+OPCODE(CALL_9)
+OPCODE(CALL_10)
+OPCODE(CALL_11)
+OPCODE(CALL_12)
+OPCODE(CALL_13)
+OPCODE(CALL_14)
+OPCODE(CALL_15)
+OPCODE(CALL_16)
+
+OPCODE(INVOKE_0)
+OPCODE(INVOKE_1)
+OPCODE(INVOKE_2)
+OPCODE(INVOKE_3)
+OPCODE(INVOKE_4)
+OPCODE(INVOKE_5)
+OPCODE(INVOKE_6)
+OPCODE(INVOKE_7)
+OPCODE(INVOKE_8)
+OPCODE(INVOKE_9)
+OPCODE(INVOKE_10)
+OPCODE(INVOKE_11)
+OPCODE(INVOKE_12)
+OPCODE(INVOKE_13)
+OPCODE(INVOKE_14)
+OPCODE(INVOKE_15)
+OPCODE(INVOKE_16)
+
+OPCODE(SUPER_0)
+OPCODE(SUPER_1)
+OPCODE(SUPER_2)
+OPCODE(SUPER_3)
+OPCODE(SUPER_4)
+OPCODE(SUPER_5)
+OPCODE(SUPER_6)
+OPCODE(SUPER_7)
+OPCODE(SUPER_8)
+OPCODE(SUPER_9)
+OPCODE(SUPER_10)
+OPCODE(SUPER_11)
+OPCODE(SUPER_12)
+OPCODE(SUPER_13)
+OPCODE(SUPER_14)
+OPCODE(SUPER_15)
+OPCODE(SUPER_16)
+
+OPCODE(ADD)
+OPCODE(SUBTRACT)
+OPCODE(MULTIPLY)
+OPCODE(DIVIDE)
+OPCODE(MODULO)
+OPCODE(LESS)
+OPCODE(GREATER)
+OPCODE(LESS_EQUAL)
+OPCODE(GREATER_EQUAL)
+OPCODE(EQUAL)
+OPCODE(NOT_EQUAL)
+OPCODE(NEGATE)
+OPCODE(NOT)
+OPCODE(GET_SUBSCRIPT)
+OPCODE(SET_SUBSCRIPT)
+OPCODE(SLICE)
+
+OPCODE(IMPORT_MODULE)
+OPCODE(IMPORT_VARIABLE)
+OPCODE(IMPORT_ALL_VARIABLES)
+OPCODE(END_MODULE)
+
+OPCODE(TUPLE)
+OPCODE(UNPACK)
+OPCODE(CLOSURE)
+OPCODE(CLOSE_UPVALUE)
+OPCODE(RETURN)
+OPCODE(RETURN_OUTPUT)
+OPCODE(CLASS)
+OPCODE(METHOD_INSTANCE)
+OPCODE(METHOD_STATIC)
+
+// Quickened instructions. The compiler never emits these. Instead, the VM
+// rewrites a generic instruction into one of these in place once it has seen
+// what the instruction operates on. They take the same operands as the generic
+// version, and rewrite themselves back to it when their guard fails.
+
+OPCODE(GET_FIELD)     // GET_PROPERTY on an instance field
+OPCODE(SET_FIELD)     // SET_PROPERTY on a field the instance already has
+OPCODE(INVOKE_CACHED) // INVOKE_n at a site that has seen one class
+
+// Superinstructions. When the compiler finishes a function, it replaces the
+// first opcode of some common pairs of instructions with one of these, and the
+// VM runs both instructions with a single dispatch. The second instruction is
+// left where it was, so jumping straight to it still works. Each of these has
+// the same operands as the first instruction of the pair.
+
+OPCODE(GET_LOCAL_GET_LOCAL)
+OPCODE(GET_LOCAL_CONSTANT)
+OPCODE(SET_LOCAL_POP)
+OPCODE(SET_GLOBAL_POP)
+OPCODE(JUMP_FALSY_POP)
+OPCODE(POP_LOOP)
+
+// These replace the first instruction of a binary operator whose operands are
+// two locals, or a local and a constant. They read the operands straight from
+// their slots, and if the result is assigned to a local, they store it there
+// too, without going through the stack. Anything that isn't a number is pushed
+// and handed to the operator instruction like usual.
+
+OPCODE(BINARY_LOCAL_LOCAL)
+OPCODE(BINARY_LOCAL_CONSTANT)
+
+// Calls that are immediately followed by a return. When the callee runs in a
+// new frame, that frame replaces the caller's, so tail calls don't use up the
+// frame stack. Natives and the like are called normally, and the return that
+// comes after runs as usual.
+
+OPCODE(TAIL_CALL_0)
+OPCODE(TAIL_CALL_1)
+OPCODE(TAIL_CALL_2)
+OPCODE(TAIL_CALL_3)
+OPCODE(TAIL_CALL_4)
+OPCODE(TAIL_CALL_5)
+OPCODE(TAIL_CALL_6)
+OPCODE(TAIL_CALL_7)
+OPCODE(TAIL_CALL_8)
+OPCODE(TAIL_CALL_9)
+OPCODE(TAIL_CALL_10)
+OPCODE(TAIL_CALL_11)
+OPCODE(TAIL_CALL_12)
+OPCODE(TAIL_CALL_13)
+OPCODE(TAIL_CALL_14)
+OPCODE(TAIL_CALL_15)
+OPCODE(TAIL_CALL_16)
+
+OPCODE(TAIL_INVOKE_0)
+OPCODE(TAIL_INVOKE_1)
+OPCODE(TAIL_INVOKE_2)
+OPCODE(TAIL_INVOKE_3)
+OPCODE(TAIL_INVOKE_4)
+OPCODE(TAIL_INVOKE_5)
+OPCODE(TAIL_INVOKE_6)
+OPCODE(TAIL_INVOKE_7)
+OPCODE(TAIL_INVOKE_8)
+OPCODE(TAIL_INVOKE_9)
+OPCODE(TAIL_INVOKE_10)
+OPCODE(TAIL_INVOKE_11)
+OPCODE(TAIL_INVOKE_12)
+OPCODE(TAIL_INVOKE_13)
+OPCODE(TAIL_INVOKE_14)
+OPCODE(TAIL_INVOKE_15)
+OPCODE(TAIL_INVOKE_16)
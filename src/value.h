@@ -50,12 +50,13 @@ typedef uint64_t Value;
 #  define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #  define IS_NONE(value)      ((value) == NONE_VAL)
 #  define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
-#  define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#  define IS_NUMBER(value)    isNumber(value)
+#  define IS_DOUBLE(value)    (((value) & QNAN) != QNAN)
 #  define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
-#  define IS_INT(value)       (((value) & (QNAN | TAG_INT)) == (QNAN | TAG_INT))
+#  define IS_INT(value)       (((value) & (SIGN_BIT | QNAN | MASK_TAG)) == (QNAN | TAG_INT))
 
 #  define AS_BOOL(value)      ((value) == TRUE_VAL)
-#  define AS_NUMBER(value)    numFromBits(value)
+#  define AS_NUMBER(value)    asNumber(value)
 #  define AS_INT(value)       ((int32_t)(((uint64_t)(value) & ~(MASK_TAG | QNAN)) >> 3))
 #  define AS_OBJ(value)       ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
@@ -68,6 +69,17 @@ typedef uint64_t Value;
 #  define INT_VAL(num)        ((Value)((((uint64_t)(uint32_t)(num)) << 3) | QNAN | TAG_INT))
 #  define OBJ_VAL(obj)        ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj)))
 
+// A Number is either a double or, for whole numbers that fit in 32 bits, an
+// int, which is what integer literals and integer arithmetic produce. Code
+// that doesn't care which can use IS_NUMBER and AS_NUMBER for both.
+static inline bool isNumber(Value value) {
+  return IS_DOUBLE(value) || IS_INT(value);
+}
+
+static inline double asNumber(Value value) {
+  return IS_INT(value) ? (double)AS_INT(value) : numFromBits(value);
+}
+
 #else
 
 typedef enum {
@@ -91,11 +103,14 @@ typedef struct {
 #  define IS_NONE(value)      ((value).type == VAL_NONE)
 #  define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #  define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
+#  define IS_DOUBLE(value)    ((value).type == VAL_NUMBER)
 #  define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#  define IS_INT(value)       false
 
 #  define AS_OBJ(value)       ((value).as.obj)
 #  define AS_BOOL(value)      ((value).as.boolean)
 #  define AS_NUMBER(value)    ((value).as.number)
+#  define AS_INT(value)       ((int32_t)(value).as.number)
 
 #  define BOOL_VAL(value)     ((Value){VAL_BOOL, {.boolean = value}})
 #  define FALSE_VAL           (BOOL_VAL(false))
@@ -104,9 +119,22 @@ typedef struct {
 #  define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
 #  define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = value}})
 #  define OBJ_VAL(object)     ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#  define INT_VAL(num)        NUMBER_VAL((double)(num))
 
 #endif
 
+#define FITS_INT(num) ((num) >= INT32_MIN && (num) <= INT32_MAX)
+
+// Makes a Number, stored as an int when [num] is whole and fits in one.
+// Negative zero stays a double, since it prints and divides differently.
+static inline Value numberToValue(double num) {
+  if (FITS_INT(num) && (double)(int32_t)num == num && numToBits(num) != numToBits(-0.0)) {
+    return INT_VAL((int32_t)num);
+  }
+
+  return NUMBER_VAL(num);
+}
+
 typedef struct {
   int capacity;
   int count;
@@ -3,6 +3,7 @@
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -11,6 +12,7 @@
 #include "core.h"
 #include "debug.h"
 #include "memory.h"
+#include "native.h"
 #include "object.h"
 #include "utils.h"
 
@@ -20,7 +22,14 @@ VM vm;
 static void resetStack();
 
 void initVM() {
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * vm.frameCapacity);
+  vm.stackCapacity = STACK_INITIAL;
+  vm.stack = (Value*)malloc(sizeof(Value) * vm.stackCapacity);
+  if (vm.frames == NULL || vm.stack == NULL) exit(1);
+
   resetStack();
+  vm.nestedRuns = 0;
   vm.objects = NULL;
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
@@ -30,11 +39,28 @@ void initVM() {
   vm.grayStack = NULL;
 
   initTable(&vm.strings);
+  initValueArray(&vm.methodNames);
 
   vm.initString = NULL;
   vm.initString = copyStringLength("init", 4);
+
+  // Calling a class looks up its initializer by the number of arguments, so
+  // the signatures are made once instead of on every call.
+  for (int arity = 0; arity <= MAX_PARAMETERS; arity++) {
+    vm.initSignatures[arity] = NULL;
+  }
+  for (int arity = 0; arity <= MAX_PARAMETERS; arity++) {
+    char signature[MAX_METHOD_SIGNATURE];
+    int length = arity == 0 ? sprintf(signature, "init()") : sprintf(signature, "init(%d)", arity);
+    vm.initSignatures[arity] = copyStringLength(signature, length);
+  }
   vm.coreString = NULL;
   vm.coreString = copyStringLength("core", 4);
+  vm.emptyShape = NULL;
+  vm.emptyShape = newShape(NULL, NULL);
+
+  // Caches start out with an epoch of 0, so they're all invalid.
+  vm.methodEpoch = 1;
 
 # if DEBUG_REMOVE_CORE
   vm.coreInitialized = true;
@@ -54,15 +80,30 @@ void freeVM() {
     }
   }
   freeTable(&vm.modules);
+  freeValueArray(&vm.methodNames);
 
   vm.initString = NULL;
+  for (int arity = 0; arity <= MAX_PARAMETERS; arity++) {
+    vm.initSignatures[arity] = NULL;
+  }
   vm.coreString = NULL;
+  vm.emptyShape = NULL;
   freeObjects();
+
+  free(vm.frames);
+  free(vm.stack);
+  vm.frames = NULL;
+  vm.stack = NULL;
+
+# if DEBUG_COUNT_OPCODE_PAIRS
+  printOpcodePairs(vm.opcodePairs);
+# endif
 }
 
 static void resetStack() {
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
+  vm.baseFrame = 0;
   vm.openUpvalues = NULL;
 }
 
@@ -138,7 +179,12 @@ static ObjClosure* compileInModule(const char* source, ObjString* name, bool pri
     popRoot();
 
     ObjModule* coreModule = getModule(vm.coreString);
-    tableAddAll(&coreModule->variables, &module->variables, false);
+    for (int i = 0; i < coreModule->slotCount; i++) {
+      ModuleVariable* variable = &coreModule->slots[i];
+      if (!IS_UNDEFINED(variable->value)) {
+        moduleDefineVariable(module, variable->name, variable->value, false);
+      }
+    }
   }
 
   ObjFunction* function = compile(source, module, printResult);
@@ -224,16 +270,274 @@ static Value peekN(int distance) {
   return vm.stackTop[-1 - distance];
 }
 
-static bool isFalsy(Value value) {
-  return IS_NONE(value) || (IS_BOOL(value) && !AS_BOOL(value));
+// Steps [iterator] forward through one of the built-in sequences the same way
+// their iterate() and iteratorValue() methods would, and puts the next item in
+// [value], or sets [done] at the end. Returns false if [seq] isn't one of them,
+// so the methods have to be called.
+static inline bool iterateBuiltIn(Value seq, Value* iterator, Value* value, bool* done) {
+  if (!IS_OBJ(seq)) return false;
+
+  *done = false;
+  switch (OBJ_TYPE(seq)) {
+    case OBJ_LIST:
+    case OBJ_TUPLE: {
+      int count;
+      Value* items;
+      if (IS_LIST(seq)) {
+        count = AS_LIST(seq)->count;
+        items = AS_LIST(seq)->items;
+      } else {
+        count = AS_TUPLE(seq)->count;
+        items = AS_TUPLE(seq)->items;
+      }
+
+      int index = IS_NONE(*iterator) ? 0 : AS_INT(*iterator) + 1;
+      if (index >= count) {
+        *done = true;
+        return true;
+      }
+
+      *iterator = INT_VAL(index);
+      *value = items[index];
+      return true;
+    }
+    case OBJ_RANGE: {
+      ObjRange* range = AS_RANGE(seq);
+      if (range->from == range->to && !range->isInclusive) {
+        *done = true;
+        return true;
+      }
+
+      double next = range->from;
+      if (!IS_NONE(*iterator)) {
+        next = AS_NUMBER(*iterator);
+        if (range->from < range->to) {
+          next++;
+          *done = next > range->to;
+        } else {
+          next--;
+          *done = next < range->to;
+        }
+        if (!range->isInclusive && next == range->to) *done = true;
+      }
+
+      *iterator = numberToValue(next);
+      *value = *iterator;
+      return true;
+    }
+    case OBJ_STRING: {
+      ObjString* string = AS_STRING(seq);
+      uint32_t index = 0;
+      if (!IS_NONE(*iterator)) {
+        // Skip the continuation bytes of the current code point.
+        index = (uint32_t)AS_INT(*iterator);
+        do {
+          index++;
+        } while (index < (uint32_t)string->length && (string->chars[index] & 0xc0) == 0x80);
+      }
+
+      if (index >= (uint32_t)string->length) {
+        *done = true;
+        return true;
+      }
+
+      *iterator = INT_VAL(index);
+      *value = OBJ_VAL(stringCodePointAt(string, index));
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Turns the number [index] into the position of an item in a sequence with
+// [count] items. Returns -1 if it isn't a whole number in bounds. Negative
+// indexes count from the end, so those are left to get() and set() as well.
+static inline int itemPosition(Value index, int count) {
+  if (IS_INT(index)) {
+    int32_t position = AS_INT(index);
+    return position >= 0 && position < count ? position : -1;
+  }
+
+  double number = AS_NUMBER(index);
+  if (number >= 0 && number < count && (int)number == number) return (int)number;
+  return -1;
+}
+
+// Runs the binary operator [instruction] on two ints, giving the same result as
+// it would with doubles. Returns false when that result isn't an int, because
+// it overflowed or is negative zero, or is a division, so the caller has to
+// use doubles after all.
+static inline bool intBinaryOp(uint8_t instruction, int64_t a, int64_t b, Value* result) {
+  int64_t value;
+  switch (instruction) {
+    case OP_ADD:           value = a + b; break;
+    case OP_SUBTRACT:      value = a - b; break;
+    case OP_MULTIPLY:
+      value = a * b;
+      if (value == 0 && (a < 0 || b < 0)) return false;
+      break;
+    case OP_MODULO:
+      if (b == 0) return false;
+      value = intModulo(a, b);
+      if (value == 0 && a < 0) return false;
+      break;
+    case OP_LESS:          *result = BOOL_VAL(a < b); return true;
+    case OP_GREATER:       *result = BOOL_VAL(a > b); return true;
+    case OP_LESS_EQUAL:    *result = BOOL_VAL(a <= b); return true;
+    case OP_GREATER_EQUAL: *result = BOOL_VAL(a >= b); return true;
+    case OP_EQUAL:         *result = BOOL_VAL(a == b); return true;
+    case OP_NOT_EQUAL:     *result = BOOL_VAL(a != b); return true;
+    default:               return false;
+  }
+
+  if (!FITS_INT(value)) return false;
+  *result = INT_VAL((int32_t)value);
+  return true;
+}
+
+// Slices a list or a string the way get() would with a Range from [from] to
+// [to]. The range only ever exists here on the C stack, since get() is the
+// only thing that would have seen it.
+static bool sliceSequence(Value seq, double from, double to, bool isInclusive, Value* result) {
+  ObjRange range;
+  range.from = from;
+  range.to = to;
+  range.isInclusive = isInclusive;
+
+  int step;
+  if (IS_LIST(seq)) {
+    ObjList* list = AS_LIST(seq);
+    uint32_t count = list->count;
+    uint32_t start = calculateRange(&range, &count, &step);
+    if (start == UINT32_MAX) return false;
+
+    ObjList* slice = newList(count);
+    for (uint32_t i = 0; i < count; i++) {
+      slice->items[i] = list->items[start + i * step];
+    }
+    *result = OBJ_VAL(slice);
+  } else {
+    ObjString* string = AS_STRING(seq);
+    uint32_t count = string->length;
+    uint32_t start = calculateRange(&range, &count, &step);
+    if (start == UINT32_MAX) return false;
+
+    *result = OBJ_VAL(stringFromRange(string, start, count, step));
+  }
+
+  return true;
+}
+
+// Finds [value] among the constants of [chunk], or adds it. Only objects are
+// looked for, since they're what module variables usually hold.
+static int findConstant(Chunk* chunk, Value value) {
+  if (IS_OBJ(value)) {
+    for (int i = 0; i < chunk->constants.count; i++) {
+      Value constant = chunk->constants.values[i];
+      if (IS_OBJ(constant) && AS_OBJ(constant) == AS_OBJ(value)) return i;
+    }
+  }
+
+  return addConstant(chunk, value);
+}
+
+// Once a function has been called often enough, the module variables it reads
+// have usually been declared. Those declared with 'val', 'fun' or 'class' can't
+// be assigned or declared again, so each read of one is replaced by a constant
+// holding its value, which skips the module. Nothing in the chunk can move, so
+// this only happens when the constant fits in as many bytes as the slot did.
+static void optimizeHotFunction(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk, offset)) {
+    if (chunk->code[offset] != OP_GET_GLOBAL) continue;
+
+    uint8_t* operand = &chunk->code[offset + 1];
+    bool isLong = operand[0] >= 0x80;
+    int slot = isLong ? ((operand[0] & 0x7f) << 8) | operand[1] : operand[0];
+
+    ModuleVariable* variable = &function->module->slots[slot];
+    if (variable->isMutable || IS_UNDEFINED(variable->value)) continue;
+
+    int constant = findConstant(chunk, variable->value);
+    if (constant > MAX_CONSTANTS || (constant >= 0x80) != isLong) continue;
+
+    if (isLong) {
+      operand[0] = 0x80 | (constant >> 8);
+      operand[1] = constant & 0xff;
+    } else {
+      operand[0] = constant;
+    }
+    chunk->code[offset] = OP_CONSTANT;
+  }
+}
+
+static inline bool fitsStackLimit(int stackCapacity, int frameCapacity) {
+  return sizeof(Value) * stackCapacity + sizeof(CallFrame) * frameCapacity <= MAX_STACK_BYTES;
+}
+
+// Grows the stack until [needed] more values fit above the top. The stack can
+// move when it grows, so everything pointing into it is moved along with it:
+// the slots of every frame, stackTop and the upvalues that are still open.
+static bool growStack(int needed) {
+  int count = (int)(vm.stackTop - vm.stack) + needed;
+  int capacity = vm.stackCapacity;
+  while (capacity < count) capacity *= 2;
+
+  if (!fitsStackLimit(capacity, vm.frameCapacity)) {
+    // Use whatever is left before giving up.
+    capacity = (int)((MAX_STACK_BYTES - sizeof(CallFrame) * vm.frameCapacity) / sizeof(Value));
+    if (capacity < count) return false;
+  }
+
+  Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+  if (stack == NULL) exit(1);
+  memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+  }
+  for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm.stack);
+  }
+  vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+  free(vm.stack);
+  vm.stack = stack;
+  vm.stackCapacity = capacity;
+  return true;
+}
+
+static bool growFrames() {
+  int capacity = vm.frameCapacity * 2;
+  if (!fitsStackLimit(vm.stackCapacity, capacity)) return false;
+
+  vm.frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * capacity);
+  if (vm.frames == NULL) exit(1);
+  vm.frameCapacity = capacity;
+  return true;
 }
 
 static bool call(ObjClosure* closure, int argCount) {
-  if (vm.frameCount == FRAMES_MAX) {
+  if (vm.frameCount == vm.frameCapacity && !growFrames()) {
+    runtimeError("Stack overflow");
+    return false;
+  }
+
+  // The function and its arguments are already on the stack. This makes room
+  // for everything else it can push, so nothing has to check while it runs.
+  int needed = closure->function->maxSlots - argCount - 1 + STACK_RESERVE;
+  if (vm.stackTop + needed > vm.stack + vm.stackCapacity && !growStack(needed)) {
     runtimeError("Stack overflow");
     return false;
   }
 
+  // Counting stops at the threshold, so the function is only optimized once.
+  ObjFunction* function = closure->function;
+  if (function->callCount < HOT_FUNCTION_CALLS && ++function->callCount == HOT_FUNCTION_CALLS) {
+    optimizeHotFunction(function);
+  }
+
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
@@ -279,32 +583,16 @@ static bool callValue(Value callee, int argCount) {
         ObjClass* cls = AS_CLASS(callee);
         vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(cls));
 
-        if (argCount == 0) {
-          Value initializer;
-          if (tableGet(&cls->obj.cls->methods, copyStringLength("init()", 6), &initializer)) {
-            if (IS_NATIVE(initializer)) return callNative(AS_NATIVE(initializer), argCount);
-            ASSERT(IS_CLOSURE(initializer), "Initializer must be a native function or a closure");
-            return callArity(AS_CLOSURE(initializer), argCount);
-          }
-
-          return true;
-        }
-
         Value initializer;
+        if (!classFindMethod(cls->obj.cls, vm.initSignatures[argCount], &initializer)) {
+          // Classes without an initializer can still be called without arguments.
+          if (argCount == 0) return true;
 
-        // TODO: There's probably a more efficient way to do this.
-        int digits = ceil(log10(argCount + 1));
-        char* name = ALLOCATE(char, 6 + digits);
-        memcpy(name, "init(", 5);
-        sprintf(name + 5, "%d", argCount);
-        name[5 + digits] = ')';
-
-        if (!tableGet(&cls->obj.cls->methods, takeString(name, 6 + digits), &initializer)) {
           runtimeError("%s does not have an initializer that accepts %d argument%s",
                        cls->name->chars, argCount, argCount == 1 ? "" : "s");
           return false;
         }
-        
+
         if (IS_NATIVE(initializer)) return callNative(AS_NATIVE(initializer), argCount);
         ASSERT(IS_CLOSURE(initializer), "Initializer must be a native function or a closure");
         return callArity(AS_CLOSURE(initializer), argCount);
@@ -321,45 +609,196 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
+static inline bool callMethod(Value method, int argCount) {
+  if (IS_NATIVE(method)) {
+    return callNative(AS_NATIVE(method), argCount);
+  }
+
+  return call(AS_CLOSURE(method), argCount);
+}
+
 static bool invokeFromClass(ObjClass* cls, ObjString* name, int argCount) {
   Value method;
-  if (!tableGet(&cls->methods, name, &method)) {
+  if (!classFindMethod(cls, name, &method)) {
     runtimeError("%s does not implement '%s'", cls->name->chars, name->chars);
     return false;
   }
 
-  if (IS_NATIVE(method)) {
-    return callNative(AS_NATIVE(method), argCount);
-  }
-
-  return call(AS_CLOSURE(method), argCount);
+  return callMethod(method, argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
-  Value receiver = peekN(argCount);
+# if DEBUG_INLINE_CACHE_STATS
+#   define CACHE_STAT(cache, counter) ((cache)->counter++)
+# else
+#   define CACHE_STAT(cache, counter) ((void)0)
+# endif
 
-  ObjClass* cls = getClass(receiver);
-  ASSERT(cls != NULL, "Class cannot be NULL");
+// Invokes the method [name] on a receiver of [cls] through the inline cache of
+// a call site. If the method could also be a field, [shape] is the receiver's
+// shape and it's part of the key, since the same shape always has the same
+// fields. Otherwise it's NULL.
+static inline bool invokeCached(ObjClass* cls, ObjShape* shape, ObjString* name, int argCount, InlineCache* cache) {
+  if (cache->epoch != vm.methodEpoch) {
+    cache->count = 0;
+    cache->megamorphic = false;
+    cache->epoch = vm.methodEpoch;
+  }
 
-  // First check if the method is a field.
-  if (IS_INSTANCE(receiver)) {
-    ObjInstance* instance = AS_INSTANCE(receiver);
-    ObjString* fieldName = copyStringLength(name->chars, name->length - (ceil(log10(argCount + 1)) + 2));
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].cls == cls && cache->entries[i].shape == shape) {
+      CACHE_STAT(cache, hits);
+      return callMethod(cache->entries[i].method, argCount);
+    }
+  }
 
-    Value field;
-    if (tableGet(&instance->fields, fieldName, &field)) {
+  // A field with the same name is called instead of the method.
+  if (shape != NULL) {
+    int slot = shapeFieldSlot(shape, cache->field);
+    if (slot >= 0) {
+      Value field = AS_INSTANCE(vm.stackTop[-argCount - 1])->fields[slot];
       vm.stackTop[-argCount - 1] = field;
       return callValue(field, argCount);
     }
   }
 
-  // If it's not a field, try to invoke it as a method.
-  return invokeFromClass(cls, name, argCount);
+  Value method;
+  if (!classFindMethod(cls, name, &method)) {
+    runtimeError("%s does not implement '%s'", cls->name->chars, name->chars);
+    return false;
+  }
+
+  if (cache->megamorphic) {
+    CACHE_STAT(cache, megamorphicCalls);
+    return callMethod(method, argCount);
+  }
+
+  CACHE_STAT(cache, misses);
+# if DEBUG_INLINE_CACHE_STATS
+  cache->name = name;
+# endif
+
+  if (cache->count < INLINE_CACHE_ENTRIES) {
+    cache->entries[cache->count].cls = cls;
+    cache->entries[cache->count].shape = shape;
+    cache->entries[cache->count].method = method;
+    cache->count++;
+  } else {
+    cache->megamorphic = true;
+  }
+
+  return callMethod(method, argCount);
+}
+
+// Finds the property [name] on a receiver of [cls] through the inline cache of
+// a property access. [shape] is the receiver's shape, or NULL if it isn't an
+// instance. A field is returned as the [slot] it's stored in, and an attribute
+// as a slot of -1 with the getter in [attribute].
+static inline bool getPropertyCached(ObjClass* cls, ObjShape* shape, ObjString* name, InlineCache* cache,
+                                     int* slot, Value* attribute) {
+  if (cache->epoch != vm.methodEpoch) {
+    cache->count = 0;
+    cache->megamorphic = false;
+    cache->epoch = vm.methodEpoch;
+  }
+
+  for (int i = 0; i < cache->count; i++) {
+    InlineCacheEntry* entry = &cache->entries[i];
+    // Where a field is only depends on the shape, but an attribute also
+    // depends on the class.
+    if (entry->shape == shape && (entry->slot >= 0 || entry->cls == cls)) {
+      CACHE_STAT(cache, hits);
+      *slot = entry->slot;
+      if (entry->slot < 0) *attribute = entry->method;
+      return true;
+    }
+  }
+
+  *slot = shape == NULL ? -1 : shapeFieldSlot(shape, name);
+
+  if (cache->megamorphic) {
+    CACHE_STAT(cache, megamorphicCalls);
+    return *slot >= 0 || classFindMethod(cls, name, attribute);
+  }
+
+  CACHE_STAT(cache, misses);
+# if DEBUG_INLINE_CACHE_STATS
+  cache->name = name;
+# endif
+
+  if (*slot < 0 && !classFindMethod(cls, name, attribute)) return false;
+
+  if (cache->count < INLINE_CACHE_ENTRIES) {
+    InlineCacheEntry* entry = &cache->entries[cache->count++];
+    entry->cls = cls;
+    entry->shape = shape;
+    entry->slot = *slot;
+    entry->method = *slot < 0 ? *attribute : NONE_VAL;
+  } else {
+    cache->megamorphic = true;
+  }
+
+  return true;
+}
+
+// Stores [value] in the field [name] of [instance] through the inline cache of
+// a property store. Fields don't depend on any method table, so unlike the
+// other caches this one ignores the epoch.
+static inline void setPropertyCached(ObjInstance* instance, ObjString* name, Value value, InlineCache* cache) {
+  ObjShape* shape = instance->shape;
+
+  for (int i = 0; i < cache->count; i++) {
+    InlineCacheEntry* entry = &cache->entries[i];
+    if (entry->shape == shape) {
+      CACHE_STAT(cache, hits);
+      if (entry->transition == NULL) {
+        instance->fields[entry->slot] = value;
+      } else {
+        instanceAddField(instance, entry->transition, value);
+      }
+      return;
+    }
+  }
+
+  instanceSetField(instance, name, value);
+
+  if (cache->megamorphic) {
+    CACHE_STAT(cache, megamorphicCalls);
+    return;
+  }
+
+  CACHE_STAT(cache, misses);
+# if DEBUG_INLINE_CACHE_STATS
+  cache->name = name;
+# endif
+
+  if (cache->count < INLINE_CACHE_ENTRIES) {
+    InlineCacheEntry* entry = &cache->entries[cache->count++];
+    entry->cls = instance->obj.cls;
+    entry->shape = shape;
+    entry->transition = instance->shape == shape ? NULL : instance->shape;
+    entry->slot = shapeFieldSlot(instance->shape, name);
+    entry->method = NONE_VAL;
+  } else {
+    cache->megamorphic = true;
+  }
+}
+
+static bool invoke(ObjString* name, int argCount, InlineCache* cache) {
+  Value receiver = peekN(argCount);
+
+  ObjClass* cls = getClass(receiver);
+  ASSERT(cls != NULL, "Class cannot be NULL");
+
+  // Only instances can have a field that's called like a method.
+  ObjShape* shape = NULL;
+  if (cache->field != NULL && IS_INSTANCE(receiver)) shape = AS_INSTANCE(receiver)->shape;
+
+  return invokeCached(cls, shape, name, argCount, cache);
 }
 
 static bool bindMethod(ObjClass* cls, ObjString* name) {
   Value method;
-  if (!tableGet(&cls->methods, name, &method)) {
+  if (!classFindMethod(cls, name, &method)) {
     runtimeError("Undefined method '%s'", name->chars);
     return false;
   }
@@ -411,406 +850,1095 @@ static void closeUpvalues(Value* last) {
   }
 }
 
+// Moves the frame that was just pushed for a call in tail position down over
+// the frame that made the call, since that one would only have returned the
+// result anyway.
+static void replaceCallerFrame() {
+  CallFrame* caller = &vm.frames[vm.frameCount - 2];
+  CallFrame* callee = &vm.frames[vm.frameCount - 1];
+  closeUpvalues(caller->slots);
+
+  int count = (int)(vm.stackTop - callee->slots);
+  memmove(caller->slots, callee->slots, sizeof(Value) * count);
+  vm.stackTop = caller->slots + count;
+
+  caller->closure = callee->closure;
+  caller->ip = callee->ip;
+  vm.frameCount--;
+}
+
 static void defineMethod(ObjClass* cls, ObjString* name) {
-  Value method = peek();
-  tableSet(&cls->methods, name, method, true);
+  // The method stays on the stack so it's rooted until it's in the class.
+  classDefineMethod(cls, name, peek());
   pop();
 }
 
 static InterpretResult run() {
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
-  register uint8_t* ip = frame->ip;
+  register CallFrame* frame;
+  register uint8_t* ip;
+  register Value* slots;
+  register Value* constants;
+
+  // Keeping these in locals instead of going through the frame every time
+  // saves a lot of pointer chasing, but they have to be reloaded whenever the
+  // current frame changes, and the ip has to be stored back to the frame
+  // before anything that might look at it (calls and runtime errors).
+# define LOAD_FRAME()                                                \
+  do {                                                               \
+    frame = &vm.frames[vm.frameCount - 1];                           \
+    ip = frame->ip;                                                  \
+    slots = frame->slots;                                            \
+    constants = frame->closure->function->chunk.constants.values;    \
+  } while (false)
+
+# define STORE_FRAME() frame->ip = ip
 
 # define READ_BYTE() (*ip++)
 # define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
-# define READ_CONSTANT()                                               \
-  (frame->closure->function->chunk.constants                           \
-       .values[*ip++ >= 0x80 ? (ip++, ((ip[-2] & 0x7f) << 8) | ip[-1]) \
-                             : ip[-1]])
+# define READ_VARIABLE() \
+  (*ip++ >= 0x80 ? (ip++, ((ip[-2] & 0x7f) << 8) | ip[-1]) : ip[-1])
+
+# define READ_CONSTANT() (constants[READ_VARIABLE()])
 
 # define READ_STRING() AS_STRING(READ_CONSTANT())
 
-  for (;;) {
-#   if DEBUG_TRACE_EXECUTION == 2
-    printf("        ");
-    printStack();
-    disassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
-#   elif DEBUG_TRACE_EXECUTION == 1
-    if (vm.coreInitialized) {
-      printf("        ");
-      printStack(&vm);
-      disassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
-    }
-#   endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(constant);
-        break;
-      }
-      case OP_NONE: push(NONE_VAL); break;
-      case OP_TRUE: push(BOOL_VAL(true)); break;
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_POP: pop(); break;
-      case OP_DUP: push(peekN(READ_BYTE())); break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek();
-        break;
-      }
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        Value value;
-        ObjModule* module = frame->closure->function->module;
-        if (!tableGet(&module->variables, name, &value)) {
-          frame->ip = ip;
-          runtimeError("Undefined variable '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
-      }
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING();
-        ObjModule* module = frame->closure->function->module;
-        if (!tableSetMutable(&module->variables, name, pop(), true)) {
-          frame->ip = ip;
-          runtimeError("Conflicting declarations of value '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_DEFINE_IMMUTABLE_GLOBAL: {
-        ObjString* name = READ_STRING();
-        ObjModule* module = frame->closure->function->module;
-        if (!tableSetMutable(&module->variables, name, pop(), false)) {
-          frame->ip = ip;
-          runtimeError("Conflicting declarations of value '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        ObjModule* module = frame->closure->function->module;
-        if (!tableContains(&module->variables, name)) {
-          frame->ip = ip;
-          runtimeError("Undefined variable '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
+# define SKIP_VARIABLE() (ip += (*ip >= 0x80 ? 2 : 1))
+
+# define READ_CACHE() (&frame->closure->function->chunk.caches[READ_VARIABLE()])
+
+  // Calls the method named by the current instruction, using its inline cache.
+# define INVOKE(argCount)                                                            \
+  do {                                                                              \
+    ObjString* method = READ_STRING();                                              \
+    InlineCache* cache = READ_CACHE();                                              \
+    STORE_FRAME();                                                                  \
+    if (!invoke(method, argCount, cache)) {                                         \
+      return INTERPRET_RUNTIME_ERROR;                                               \
+    }                                                                               \
+    LOAD_FRAME();                                                                   \
+  } while (false)
+
+  // Operators are done right here when both operands are numbers, which skips
+  // the method signature and the inline cache. Anything else calls the method.
+# define BINARY_OP(valueType, operation)          \
+  do {                                            \
+    Value left = vm.stackTop[-2];                 \
+    Value right = vm.stackTop[-1];                \
+    if (IS_NUMBER(left) && IS_NUMBER(right)) {    \
+      double a = AS_NUMBER(left);                 \
+      double b = AS_NUMBER(right);                \
+      vm.stackTop--;                              \
+      vm.stackTop[-1] = valueType(operation);     \
+      SKIP_VARIABLE();                            \
+      SKIP_VARIABLE();                            \
+    } else {                                      \
+      INVOKE(1);                                  \
+    }                                             \
+  } while (false)
+
+  // Runs the operator [instruction] straight on two ints, unless the result
+  // isn't an int. Then BINARY_OP, which comes next, works it out.
+# define INT_BINARY_OP(instruction)                                         \
+  do {                                                                     \
+    Value left = vm.stackTop[-2];                                          \
+    Value right = vm.stackTop[-1];                                         \
+    Value result;                                                          \
+    if (IS_INT(left) && IS_INT(right) &&                                   \
+        intBinaryOp(instruction, AS_INT(left), AS_INT(right), &result)) {  \
+      vm.stackTop--;                                                       \
+      vm.stackTop[-1] = result;                                            \
+      SKIP_VARIABLE();                                                     \
+      SKIP_VARIABLE();                                                     \
+      DISPATCH();                                                          \
+    }                                                                      \
+  } while (false)
+
+# if DEBUG_TRACE_EXECUTION == 2
+#   define TRACE_INSTRUCTION()                                                    \
+      do {                                                                        \
+        printf("        ");                                                       \
+        printStack(&vm);                                                          \
+        disassembleInstruction(&frame->closure->function->chunk,                  \
+                               (int)(ip - frame->closure->function->chunk.code)); \
+      } while (false)
+# elif DEBUG_TRACE_EXECUTION == 1
+#   define TRACE_INSTRUCTION()                                                      \
+      do {                                                                          \
+        if (vm.coreInitialized) {                                                   \
+          printf("        ");                                                       \
+          printStack(&vm);                                                          \
+          disassembleInstruction(&frame->closure->function->chunk,                  \
+                                 (int)(ip - frame->closure->function->chunk.code)); \
+        }                                                                           \
+      } while (false)
+# else
+#   define TRACE_INSTRUCTION() do {} while (false)
+# endif
 
-        if (!tableSetMutable(&module->variables, name, peek(), true)) {
-          frame->ip = ip;
-          runtimeError("Value '%s' cannot be reassigned", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+# if DEBUG_COUNT_OPCODE_PAIRS
+  // The previous instruction is still in `instruction`, and ip points at the
+  // next one.
+#   define COUNT_INSTRUCTION() (vm.opcodePairs[instruction][*ip]++)
+# else
+#   define COUNT_INSTRUCTION() do {} while (false)
+# endif
+
+# if COMPUTED_GOTO
+
+  static void* dispatchTable[] = {
+#   define OPCODE(name) &&code_##name,
+#   include "opcodes.h"
+#   undef OPCODE
+  };
+
+#   define INTERPRET_LOOP    DISPATCH();
+#   define CASE_CODE(name)   code_##name
+
+#   define DISPATCH()                                   \
+      do {                                              \
+        TRACE_INSTRUCTION();                            \
+        COUNT_INSTRUCTION();                            \
+        goto *dispatchTable[instruction = READ_BYTE()]; \
+      } while (false)
+
+# else
+
+#   define INTERPRET_LOOP        \
+      loop:                      \
+        TRACE_INSTRUCTION();     \
+        COUNT_INSTRUCTION();     \
+        switch (instruction = READ_BYTE())
+
+#   define CASE_CODE(name)   case OP_##name
+#   define DISPATCH()        goto loop
+
+# endif
+
+  uint8_t instruction = OP_NONE;
+  LOAD_FRAME();
+
+  INTERPRET_LOOP
+  {
+    CASE_CODE(CONSTANT): {
+      Value constant = READ_CONSTANT();
+      push(constant);
+      DISPATCH();
+    }
+    CASE_CODE(NONE): push(NONE_VAL); DISPATCH();
+    CASE_CODE(TRUE): push(BOOL_VAL(true)); DISPATCH();
+    CASE_CODE(FALSE): push(BOOL_VAL(false)); DISPATCH();
+    CASE_CODE(POP): pop(); DISPATCH();
+    CASE_CODE(POP_LOOP): {
+      pop();
+      ip++; // OP_LOOP
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      DISPATCH();
+    }
+    CASE_CODE(DUP): push(peekN(READ_BYTE())); DISPATCH();
+    CASE_CODE(GET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      push(slots[slot]);
+      DISPATCH();
+    }
+    CASE_CODE(GET_LOCAL_GET_LOCAL): {
+      uint8_t first = READ_BYTE();
+      ip++; // OP_GET_LOCAL
+      uint8_t second = READ_BYTE();
+      push(slots[first]);
+      push(slots[second]);
+      DISPATCH();
+    }
+    CASE_CODE(GET_LOCAL_CONSTANT): {
+      uint8_t slot = READ_BYTE();
+      ip++; // OP_CONSTANT
+      push(slots[slot]);
+      push(READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE_CODE(BINARY_LOCAL_LOCAL):
+    CASE_CODE(BINARY_LOCAL_CONSTANT): {
+      Value left = slots[READ_BYTE()];
+      Value right;
+      if (instruction == OP_BINARY_LOCAL_LOCAL) {
+        ip++; // OP_GET_LOCAL
+        right = slots[READ_BYTE()];
+      } else {
+        ip++; // OP_CONSTANT
+        right = READ_CONSTANT();
+      }
+
+      // Let the operator instruction deal with anything else.
+      if (!IS_NUMBER(left) || !IS_NUMBER(right)) {
+        push(left);
+        push(right);
+        DISPATCH();
+      }
+
+      uint8_t operator = READ_BYTE();
+      Value result;
+      if (!IS_INT(left) || !IS_INT(right) || !intBinaryOp(operator, AS_INT(left), AS_INT(right), &result)) {
+        double a = AS_NUMBER(left);
+        double b = AS_NUMBER(right);
+        switch (operator) {
+          case OP_ADD:           result = NUMBER_VAL(a + b); break;
+          case OP_SUBTRACT:      result = NUMBER_VAL(a - b); break;
+          case OP_MULTIPLY:      result = NUMBER_VAL(a * b); break;
+          case OP_DIVIDE:        result = NUMBER_VAL(a / b); break;
+          case OP_MODULO:        result = NUMBER_VAL(numberModulo(a, b)); break;
+          case OP_LESS:          result = BOOL_VAL(a < b); break;
+          case OP_GREATER:       result = BOOL_VAL(a > b); break;
+          case OP_LESS_EQUAL:    result = BOOL_VAL(a <= b); break;
+          case OP_GREATER_EQUAL: result = BOOL_VAL(a >= b); break;
+          case OP_EQUAL:         result = BOOL_VAL(a == b); break;
+          case OP_NOT_EQUAL:     result = BOOL_VAL(a != b); break;
+          default:
+            ASSERT(false, "Expecting a binary operator");
+            result = NONE_VAL;
         }
-        break;
       }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
+      SKIP_VARIABLE();
+      SKIP_VARIABLE();
+
+      // Assign straight to the local if that's what happens next.
+      if (*ip == OP_SET_LOCAL_POP) {
+        slots[ip[1]] = result;
+        ip += 3;
+      } else {
+        push(result);
+      }
+      DISPATCH();
+    }
+    CASE_CODE(SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = peek();
+      DISPATCH();
+    }
+    CASE_CODE(SET_LOCAL_POP): {
+      uint8_t slot = READ_BYTE();
+      ip++; // OP_POP
+      slots[slot] = pop();
+      DISPATCH();
+    }
+    CASE_CODE(GET_GLOBAL): {
+      ModuleVariable* variable = &frame->closure->function->module->slots[READ_VARIABLE()];
+      if (IS_UNDEFINED(variable->value)) {
+        STORE_FRAME();
+        runtimeError("Undefined variable '%s'", variable->name->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      push(variable->value);
+      DISPATCH();
+    }
+    CASE_CODE(DEFINE_GLOBAL):
+    CASE_CODE(DEFINE_IMMUTABLE_GLOBAL): {
+      ModuleVariable* variable = &frame->closure->function->module->slots[READ_VARIABLE()];
+      if (!variable->isMutable) {
+        STORE_FRAME();
+        runtimeError("Conflicting declarations of value '%s'", variable->name->chars);
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek();
-        break;
+      variable->value = pop();
+      variable->isMutable = instruction == OP_DEFINE_GLOBAL;
+      DISPATCH();
+    }
+    CASE_CODE(SET_GLOBAL):
+    CASE_CODE(SET_GLOBAL_POP): {
+      ModuleVariable* variable = &frame->closure->function->module->slots[READ_VARIABLE()];
+      if (IS_UNDEFINED(variable->value)) {
+        STORE_FRAME();
+        runtimeError("Undefined variable '%s'", variable->name->chars);
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_GET_PROPERTY: {
-        Value receiver = peek();
-        ObjClass* cls = getClass(receiver);
-        ASSERT(cls != NULL, "Class cannot be NULL");
 
-        ObjString* property = READ_STRING();
+      if (!variable->isMutable) {
+        STORE_FRAME();
+        runtimeError("Value '%s' cannot be reassigned", variable->name->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
 
-        if (IS_INSTANCE(receiver)) {
-          ObjInstance* instance = AS_INSTANCE(receiver);
+      variable->value = peek();
+      if (instruction == OP_SET_GLOBAL_POP) {
+        ip++; // OP_POP
+        pop();
+      }
+      DISPATCH();
+    }
+    CASE_CODE(GET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      push(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE_CODE(SET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      *frame->closure->upvalues[slot]->location = peek();
+      DISPATCH();
+    }
+    CASE_CODE(GET_PROPERTY): {
+      uint8_t* start = ip - 1;
+      Value receiver = peek();
+      ObjClass* cls = getClass(receiver);
+      ASSERT(cls != NULL, "Class cannot be NULL");
+
+      ObjString* property = READ_STRING();
+      InlineCache* cache = READ_CACHE();
+      ObjShape* shape = IS_INSTANCE(receiver) ? AS_INSTANCE(receiver)->shape : NULL;
+
+      int slot;
+      Value attribute;
+      if (!getPropertyCached(cls, shape, property, cache, &slot, &attribute)) {
+        STORE_FRAME();
+        runtimeError("Undefined property '%s'", property->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
 
-          Value value;
-          if (tableGet(&instance->fields, property, &value)) {
-            pop(); // Instance
-            push(value);
-            break;
-          }
-        }
+      if (slot >= 0) {
+        // Only one shape has been seen here, so the field can be read straight
+        // from its first cache entry.
+        if (cache->count == 1) *start = OP_GET_FIELD;
+        vm.stackTop[-1] = AS_INSTANCE(receiver)->fields[slot];
+        DISPATCH();
+      }
 
-        Value attribute;
-        if (!tableGet(&cls->methods, property, &attribute)) {
-          frame->ip = ip;
-          runtimeError("Undefined property '%s'", property->chars);
+      if (IS_NATIVE(attribute)) {
+        ObjNative* native = AS_NATIVE(attribute);
+        // Replaces the instance with the result.
+        STORE_FRAME();
+        if (!native->function(vm.stackTop - 1)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-
-        if (IS_NATIVE(attribute)) {
-          ObjNative* native = AS_NATIVE(attribute);
-          // Replaces the instance with the result.
-          if (!native->function(vm.stackTop - 1)) {
-            return INTERPRET_RUNTIME_ERROR;
-          }
-        } else {
-          frame->ip = ip;
-          if (!call(AS_CLOSURE(attribute), 0)) {
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          frame = &vm.frames[vm.frameCount - 1];
-          ip = frame->ip;
-        }
-        break;
-      }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek2())) {
-          frame->ip = ip;
-          runtimeError("Only instances have fields");
+        // The native could have called back into the VM and moved the stack.
+        LOAD_FRAME();
+      } else {
+        STORE_FRAME();
+        if (!call(AS_CLOSURE(attribute), 0)) {
           return INTERPRET_RUNTIME_ERROR;
         }
+        LOAD_FRAME();
+      }
+      DISPATCH();
+    }
+    CASE_CODE(GET_FIELD): {
+      uint8_t* start = ip - 1;
+      SKIP_VARIABLE();
+      InlineCache* cache = READ_CACHE();
+
+      Value receiver = peek();
+      if (IS_INSTANCE(receiver) && AS_INSTANCE(receiver)->shape == cache->entries[0].shape) {
+        CACHE_STAT(cache, hits);
+        vm.stackTop[-1] = AS_INSTANCE(receiver)->fields[cache->entries[0].slot];
+        DISPATCH();
+      }
 
-        ObjInstance* instance = AS_INSTANCE(peek2());
-        tableSet(&instance->fields, READ_STRING(), peek(), true);
-        Value value = pop();
-        pop();
-        push(value);
-        break;
+      // A different shape, so go back to the generic instruction and run it.
+      *start = OP_GET_PROPERTY;
+      ip = start;
+      DISPATCH();
+    }
+    CASE_CODE(SET_PROPERTY): {
+      uint8_t* start = ip - 1;
+      if (!IS_INSTANCE(peek2())) {
+        STORE_FRAME();
+        runtimeError("Only instances have fields");
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_BIND_METHOD: {
-        Value value = peek();
-        ObjClass* cls = getClass(value);
 
-        frame->ip = ip;
-        if (cls == NULL) {
-          runtimeError("Value does not belong to a class");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      ObjInstance* instance = AS_INSTANCE(peek2());
+      ObjString* property = READ_STRING();
+      InlineCache* cache = READ_CACHE();
+      setPropertyCached(instance, property, peek(), cache);
 
-        if (!bindMethod(cls, READ_STRING())) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      // Only one shape has been seen here, and it already had the field, so
+      // the store can go straight to its slot.
+      if (cache->count == 1 && cache->entries[0].transition == NULL) *start = OP_SET_FIELD;
 
-        break;
+      Value value = pop();
+      pop();
+      push(value);
+      DISPATCH();
+    }
+    CASE_CODE(SET_FIELD): {
+      uint8_t* start = ip - 1;
+      SKIP_VARIABLE();
+      InlineCache* cache = READ_CACHE();
+
+      Value receiver = peek2();
+      if (IS_INSTANCE(receiver) && AS_INSTANCE(receiver)->shape == cache->entries[0].shape) {
+        CACHE_STAT(cache, hits);
+        AS_INSTANCE(receiver)->fields[cache->entries[0].slot] = peek();
+        vm.stackTop[-2] = vm.stackTop[-1];
+        vm.stackTop--;
+        DISPATCH();
       }
-      case OP_BIND_SUPER: {
-        ObjClass* superclass = getClass(peek());
-        ASSERT(superclass != NULL, "Superclass cannot be NULL");
 
-        ObjString* method = READ_STRING();
+      // A different shape, or not an instance at all.
+      *start = OP_SET_PROPERTY;
+      ip = start;
+      DISPATCH();
+    }
+    CASE_CODE(BIND_METHOD): {
+      Value value = peek();
+      ObjClass* cls = getClass(value);
 
-        frame->ip = ip;
-        if (!bindMethod(superclass, method)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      STORE_FRAME();
+      if (cls == NULL) {
+        runtimeError("Value does not belong to a class");
+        return INTERPRET_RUNTIME_ERROR;
+      }
 
-        break;
+      if (!bindMethod(cls, READ_STRING())) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_PRINT: {
-        Value output = peek();
-        if (IS_STRING(output)) {
-          printf("%s\n", AS_STRING(output)->chars);
-        } else {
-          printf("%s\n", "[invalid toString() method]");
-        }
-        pop(); // The string
-        break;
-      }
-      case OP_ERROR: {
-        Value output = peek();
-        frame->ip = ip;
-        if (IS_STRING(output)) {
-          runtimeError(AS_CSTRING(output));
-        } else {
-          runtimeError("[invalid toString() method]");
-        }
+
+      DISPATCH();
+    }
+    CASE_CODE(BIND_SUPER): {
+      ObjClass* superclass = getClass(peek());
+      ASSERT(superclass != NULL, "Superclass cannot be NULL");
+
+      ObjString* method = READ_STRING();
+
+      STORE_FRAME();
+      if (!bindMethod(superclass, method)) {
         return INTERPRET_RUNTIME_ERROR;
-        break;
       }
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
+
+      DISPATCH();
+    }
+    CASE_CODE(PRINT): {
+      Value output = peek();
+      if (IS_STRING(output)) {
+        printf("%s\n", AS_STRING(output)->chars);
+      } else {
+        printf("%s\n", "[invalid toString() method]");
+      }
+      pop(); // The string
+      DISPATCH();
+    }
+    CASE_CODE(ERROR): {
+      Value output = peek();
+      STORE_FRAME();
+      if (IS_STRING(output)) {
+        runtimeError(AS_CSTRING(output));
+      } else {
+        runtimeError("[invalid toString() method]");
+      }
+      return INTERPRET_RUNTIME_ERROR;
+    }
+    CASE_CODE(JUMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE_CODE(JUMP_FALSY): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsy(peek())) ip += offset;
+      DISPATCH();
+    }
+    CASE_CODE(JUMP_FALSY_POP): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsy(peek())) {
         ip += offset;
-        break;
+      } else {
+        ip++; // OP_POP
+        pop();
       }
-      case OP_JUMP_FALSY: {
-        uint16_t offset = READ_SHORT();
-        if (isFalsy(peek())) ip += offset;
-        break;
+      DISPATCH();
+    }
+    CASE_CODE(JUMP_TRUTHY): {
+      uint16_t offset = READ_SHORT();
+      if (!isFalsy(peek())) ip += offset;
+      DISPATCH();
+    }
+    CASE_CODE(JUMP_TRUTHY_POP): {
+      uint16_t offset = READ_SHORT();
+      if (!isFalsy(peek())) ip += offset;
+      pop();
+      DISPATCH();
+    }
+    CASE_CODE(LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      DISPATCH();
+    }
+    CASE_CODE(RANGE_START): {
+      bool isInclusive = READ_BYTE();
+      uint16_t testOffset = READ_SHORT();
+      uint8_t* test = ip + testOffset;
+      uint16_t bodyOffset = READ_SHORT();
+
+      // Let the operator make a sequence out of anything else.
+      Value from = peek2();
+      Value to = peek();
+      if (!IS_NUMBER(from) || !IS_NUMBER(to)) DISPATCH();
+
+      // The end goes where the sequence usually is, and the number where the
+      // iterator is, just like a Range's iterator.
+      vm.stackTop[-2] = to;
+      vm.stackTop[-1] = from;
+      push(INT_VAL(AS_NUMBER(from) < AS_NUMBER(to) ? 1 : -1));
+
+      if (!isInclusive && AS_NUMBER(from) == AS_NUMBER(to)) {
+        push(FALSE_VAL);
+        ip = test;
+      } else {
+        push(from);
+        ip += bodyOffset;
       }
-      case OP_JUMP_TRUTHY: {
-        uint16_t offset = READ_SHORT();
-        if (!isFalsy(peek())) ip += offset;
-        break;
+      DISPATCH();
+    }
+    CASE_CODE(RANGE_NEXT): {
+      Value* seq = &slots[READ_BYTE()];
+      uint16_t testOffset = READ_SHORT();
+      uint8_t* test = ip + testOffset;
+      uint16_t bodyOffset = READ_SHORT();
+      uint8_t* body = ip + bodyOffset;
+      bool isInclusive = READ_BYTE();
+
+      Value value;
+      bool done;
+      if (IS_INT(seq[1]) && IS_INT(seq[2])) {
+        // Counting from RANGE_START with ints, which is what it starts with
+        // unless the range does.
+        int64_t step = AS_INT(seq[2]);
+        int64_t next = AS_INT(seq[1]) + step;
+        double to = AS_NUMBER(seq[0]);
+        if (step > 0) done = isInclusive ? next > to : next >= to;
+        else done = isInclusive ? next < to : next <= to;
+
+        seq[1] = FITS_INT(next) ? INT_VAL((int32_t)next) : NUMBER_VAL((double)next);
+        value = seq[1];
+      } else if (IS_NUMBER(seq[2])) {
+        // Counting from RANGE_START with doubles.
+        double step = AS_NUMBER(seq[2]);
+        double next = AS_NUMBER(seq[1]) + step;
+        double to = AS_NUMBER(seq[0]);
+        if (step > 0) done = isInclusive ? next > to : next >= to;
+        else done = isInclusive ? next < to : next <= to;
+
+        seq[1] = NUMBER_VAL(next);
+        value = seq[1];
+      } else if (!iterateBuiltIn(seq[0], &seq[1], &value, &done)) {
+        DISPATCH();
       }
-      case OP_JUMP_TRUTHY_POP: {
-        uint16_t offset = READ_SHORT();
-        if (!isFalsy(peek())) ip += offset;
-        pop();
-        break;
-      }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        ip -= offset;
-        break;
-      }
-      case OP_CALL_0: case OP_CALL_1: case OP_CALL_2: case OP_CALL_3: case OP_CALL_4:
-      case OP_CALL_5: case OP_CALL_6: case OP_CALL_7: case OP_CALL_8: case OP_CALL_9:
-      case OP_CALL_10: case OP_CALL_11: case OP_CALL_12: case OP_CALL_13:
-      case OP_CALL_14: case OP_CALL_15: case OP_CALL_16: {
-        int argCount = instruction - OP_CALL_0;
-        frame->ip = ip;
-        if (!callValue(peekN(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        ip = frame->ip;
-        break;
-      }
-      case OP_INVOKE_0: case OP_INVOKE_1: case OP_INVOKE_2: case OP_INVOKE_3: case OP_INVOKE_4:
-      case OP_INVOKE_5: case OP_INVOKE_6: case OP_INVOKE_7: case OP_INVOKE_8: case OP_INVOKE_9:
-      case OP_INVOKE_10: case OP_INVOKE_11: case OP_INVOKE_12: case OP_INVOKE_13:
-      case OP_INVOKE_14: case OP_INVOKE_15: case OP_INVOKE_16: {
-        int argCount = instruction - OP_INVOKE_0;
-        ObjString* method = READ_STRING();
-        frame->ip = ip;
-        if (!invoke(method, argCount)) {
+
+      if (done) {
+        seq[1] = FALSE_VAL;
+        push(FALSE_VAL);
+        ip = test;
+      } else {
+        push(value);
+        ip = body;
+      }
+      DISPATCH();
+    }
+    CASE_CODE(ITER_NEXT): {
+      Value* seq = &slots[READ_BYTE()];
+      uint16_t testOffset = READ_SHORT();
+      uint8_t* test = ip + testOffset;
+      uint16_t bodyOffset = READ_SHORT();
+
+      // The iterator is always the slot after the sequence.
+      Value value;
+      bool done;
+      if (!iterateBuiltIn(seq[0], &seq[1], &value, &done)) DISPATCH();
+
+      if (done) {
+        // The exit check sees the same False that iterate() would return.
+        seq[1] = FALSE_VAL;
+        push(FALSE_VAL);
+        ip = test;
+      } else {
+        push(value);
+        ip += bodyOffset;
+      }
+      DISPATCH();
+    }
+    CASE_CODE(CALL_0): CASE_CODE(CALL_1): CASE_CODE(CALL_2): CASE_CODE(CALL_3):
+    CASE_CODE(CALL_4): CASE_CODE(CALL_5): CASE_CODE(CALL_6): CASE_CODE(CALL_7):
+    CASE_CODE(CALL_8): CASE_CODE(CALL_9): CASE_CODE(CALL_10): CASE_CODE(CALL_11):
+    CASE_CODE(CALL_12): CASE_CODE(CALL_13): CASE_CODE(CALL_14): CASE_CODE(CALL_15):
+    CASE_CODE(CALL_16): {
+      int argCount = instruction - OP_CALL_0;
+      STORE_FRAME();
+      if (!callValue(peekN(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(INVOKE_0): CASE_CODE(INVOKE_1): CASE_CODE(INVOKE_2): CASE_CODE(INVOKE_3):
+    CASE_CODE(INVOKE_4): CASE_CODE(INVOKE_5): CASE_CODE(INVOKE_6): CASE_CODE(INVOKE_7):
+    CASE_CODE(INVOKE_8): CASE_CODE(INVOKE_9): CASE_CODE(INVOKE_10): CASE_CODE(INVOKE_11):
+    CASE_CODE(INVOKE_12): CASE_CODE(INVOKE_13): CASE_CODE(INVOKE_14): CASE_CODE(INVOKE_15):
+    CASE_CODE(INVOKE_16): {
+      uint8_t* start = ip - 1;
+      int argCount = instruction - OP_INVOKE_0;
+      ObjString* method = READ_STRING();
+      InlineCache* cache = READ_CACHE();
+      STORE_FRAME();
+      if (!invoke(method, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      // Only one class has been seen here, so the method can be called
+      // straight from the first cache entry.
+      if (cache->count == 1 && !cache->megamorphic) {
+        cache->argCount = (uint8_t)argCount;
+        *start = OP_INVOKE_CACHED;
+      }
+
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(INVOKE_CACHED): {
+      uint8_t* start = ip - 1;
+      SKIP_VARIABLE();
+      InlineCache* cache = READ_CACHE();
+      int argCount = cache->argCount;
+
+      // The same key invoke() looks the method up with.
+      Value receiver = peekN(argCount);
+      ObjShape* shape = NULL;
+      if (cache->field != NULL && IS_INSTANCE(receiver)) shape = AS_INSTANCE(receiver)->shape;
+
+      InlineCacheEntry* entry = &cache->entries[0];
+      if (cache->epoch == vm.methodEpoch && getClass(receiver) == entry->cls && shape == entry->shape) {
+        CACHE_STAT(cache, hits);
+        STORE_FRAME();
+        if (!callMethod(entry->method, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        ip = frame->ip;
-        break;
-      }
-      case OP_SUPER_0: case OP_SUPER_1: case OP_SUPER_2: case OP_SUPER_3: case OP_SUPER_4:
-      case OP_SUPER_5: case OP_SUPER_6: case OP_SUPER_7: case OP_SUPER_8: case OP_SUPER_9:
-      case OP_SUPER_10: case OP_SUPER_11: case OP_SUPER_12: case OP_SUPER_13:
-      case OP_SUPER_14: case OP_SUPER_15: case OP_SUPER_16: {
-        int argCount = instruction - OP_SUPER_0;
-        ObjString* name = READ_STRING();
-        ObjClass* superclass = AS_CLASS(pop());
-        frame->ip = ip;
-        if (!invokeFromClass(superclass, name, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+        LOAD_FRAME();
+        DISPATCH();
+      }
+
+      // Another class, or the methods have changed since.
+      *start = OP_INVOKE_0 + argCount;
+      ip = start;
+      DISPATCH();
+    }
+    CASE_CODE(TAIL_CALL_0): CASE_CODE(TAIL_CALL_1): CASE_CODE(TAIL_CALL_2): CASE_CODE(TAIL_CALL_3):
+    CASE_CODE(TAIL_CALL_4): CASE_CODE(TAIL_CALL_5): CASE_CODE(TAIL_CALL_6): CASE_CODE(TAIL_CALL_7):
+    CASE_CODE(TAIL_CALL_8): CASE_CODE(TAIL_CALL_9): CASE_CODE(TAIL_CALL_10): CASE_CODE(TAIL_CALL_11):
+    CASE_CODE(TAIL_CALL_12): CASE_CODE(TAIL_CALL_13): CASE_CODE(TAIL_CALL_14): CASE_CODE(TAIL_CALL_15):
+    CASE_CODE(TAIL_CALL_16): {
+      int argCount = instruction - OP_TAIL_CALL_0;
+      int frameCount = vm.frameCount;
+      STORE_FRAME();
+      if (!callValue(peekN(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (vm.frameCount > frameCount) replaceCallerFrame();
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(TAIL_INVOKE_0): CASE_CODE(TAIL_INVOKE_1): CASE_CODE(TAIL_INVOKE_2): CASE_CODE(TAIL_INVOKE_3):
+    CASE_CODE(TAIL_INVOKE_4): CASE_CODE(TAIL_INVOKE_5): CASE_CODE(TAIL_INVOKE_6): CASE_CODE(TAIL_INVOKE_7):
+    CASE_CODE(TAIL_INVOKE_8): CASE_CODE(TAIL_INVOKE_9): CASE_CODE(TAIL_INVOKE_10): CASE_CODE(TAIL_INVOKE_11):
+    CASE_CODE(TAIL_INVOKE_12): CASE_CODE(TAIL_INVOKE_13): CASE_CODE(TAIL_INVOKE_14): CASE_CODE(TAIL_INVOKE_15):
+    CASE_CODE(TAIL_INVOKE_16): {
+      int frameCount = vm.frameCount;
+      INVOKE(instruction - OP_TAIL_INVOKE_0);
+      if (vm.frameCount > frameCount) {
+        replaceCallerFrame();
+        LOAD_FRAME();
+      }
+      DISPATCH();
+    }
+    CASE_CODE(SUPER_0): CASE_CODE(SUPER_1): CASE_CODE(SUPER_2): CASE_CODE(SUPER_3):
+    CASE_CODE(SUPER_4): CASE_CODE(SUPER_5): CASE_CODE(SUPER_6): CASE_CODE(SUPER_7):
+    CASE_CODE(SUPER_8): CASE_CODE(SUPER_9): CASE_CODE(SUPER_10): CASE_CODE(SUPER_11):
+    CASE_CODE(SUPER_12): CASE_CODE(SUPER_13): CASE_CODE(SUPER_14): CASE_CODE(SUPER_15):
+    CASE_CODE(SUPER_16): {
+      int argCount = instruction - OP_SUPER_0;
+      ObjString* name = READ_STRING();
+      ObjClass* superclass = AS_CLASS(pop());
+      STORE_FRAME();
+      if (!invokeFromClass(superclass, name, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(ADD): {
+      INT_BINARY_OP(OP_ADD);
+      BINARY_OP(NUMBER_VAL, a + b);
+      DISPATCH();
+    }
+    CASE_CODE(SUBTRACT): {
+      INT_BINARY_OP(OP_SUBTRACT);
+      BINARY_OP(NUMBER_VAL, a - b);
+      DISPATCH();
+    }
+    CASE_CODE(MULTIPLY): {
+      INT_BINARY_OP(OP_MULTIPLY);
+      BINARY_OP(NUMBER_VAL, a * b);
+      DISPATCH();
+    }
+    CASE_CODE(DIVIDE): {
+      BINARY_OP(NUMBER_VAL, a / b);
+      DISPATCH();
+    }
+    CASE_CODE(MODULO): {
+      INT_BINARY_OP(OP_MODULO);
+      BINARY_OP(NUMBER_VAL, numberModulo(a, b));
+      DISPATCH();
+    }
+    CASE_CODE(LESS): {
+      INT_BINARY_OP(OP_LESS);
+      BINARY_OP(BOOL_VAL, a < b);
+      DISPATCH();
+    }
+    CASE_CODE(GREATER): {
+      INT_BINARY_OP(OP_GREATER);
+      BINARY_OP(BOOL_VAL, a > b);
+      DISPATCH();
+    }
+    CASE_CODE(LESS_EQUAL): {
+      INT_BINARY_OP(OP_LESS_EQUAL);
+      BINARY_OP(BOOL_VAL, a <= b);
+      DISPATCH();
+    }
+    CASE_CODE(GREATER_EQUAL): {
+      INT_BINARY_OP(OP_GREATER_EQUAL);
+      BINARY_OP(BOOL_VAL, a >= b);
+      DISPATCH();
+    }
+    CASE_CODE(EQUAL): {
+      INT_BINARY_OP(OP_EQUAL);
+      BINARY_OP(BOOL_VAL, a == b);
+      DISPATCH();
+    }
+    CASE_CODE(NOT_EQUAL): {
+      INT_BINARY_OP(OP_NOT_EQUAL);
+      BINARY_OP(BOOL_VAL, a != b);
+      DISPATCH();
+    }
+    CASE_CODE(NEGATE): {
+      Value operand = vm.stackTop[-1];
+      if (IS_INT(operand) && AS_INT(operand) != 0 && AS_INT(operand) != INT32_MIN) {
+        vm.stackTop[-1] = INT_VAL(-AS_INT(operand));
+        SKIP_VARIABLE();
+        SKIP_VARIABLE();
+      } else if (IS_NUMBER(operand)) {
+        vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(operand));
+        SKIP_VARIABLE();
+        SKIP_VARIABLE();
+      } else {
+        INVOKE(0);
+      }
+      DISPATCH();
+    }
+    CASE_CODE(GET_SUBSCRIPT): {
+      // Lists and tuples with an index that's already in bounds are read right
+      // here. Everything else, including negative indexes, calls get().
+      Value receiver = vm.stackTop[-2];
+      Value index = vm.stackTop[-1];
+      if (IS_OBJ(receiver) && IS_NUMBER(index)) {
+        Value* items = NULL;
+        int count = 0;
+        if (IS_LIST(receiver)) {
+          items = AS_LIST(receiver)->items;
+          count = AS_LIST(receiver)->count;
+        } else if (IS_TUPLE(receiver)) {
+          items = AS_TUPLE(receiver)->items;
+          count = AS_TUPLE(receiver)->count;
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        ip = frame->ip;
-        break;
-      }
-      case OP_IMPORT_MODULE: {
-        frame->ip = ip;
-        Value module = importModule(READ_STRING());
-        if (IS_NONE(module)) return INTERPRET_RUNTIME_ERROR;
-        push(module);
-
-        if (IS_CLOSURE(module)) {
-          frame->ip = ip;
-          ObjClosure* closure = AS_CLOSURE(module);
-          call(closure, 0);
-          frame = &vm.frames[vm.frameCount - 1];
-          ip = frame->ip;
-        } else {
-          vm.lastModule = AS_MODULE(module);
+
+        int position = itemPosition(index, count);
+        if (position != -1) {
+          vm.stackTop[-2] = items[position];
+          vm.stackTop--;
+          SKIP_VARIABLE();
+          SKIP_VARIABLE();
+          DISPATCH();
         }
+      }
 
-        break;
+      INVOKE(1);
+      DISPATCH();
+    }
+    CASE_CODE(SET_SUBSCRIPT): {
+      Value receiver = vm.stackTop[-3];
+      Value index = vm.stackTop[-2];
+      if (IS_LIST(receiver) && IS_NUMBER(index)) {
+        ObjList* list = AS_LIST(receiver);
+        int position = itemPosition(index, list->count);
+        if (position != -1) {
+          list->items[position] = vm.stackTop[-1];
+          vm.stackTop[-3] = vm.stackTop[-1];
+          vm.stackTop -= 2;
+          SKIP_VARIABLE();
+          SKIP_VARIABLE();
+          DISPATCH();
+        }
       }
-      case OP_IMPORT_VARIABLE: {
-        ObjString* name = READ_STRING();
-        ASSERT(vm.lastModule != NULL, "Module should be imported already");
-        Value result;
-        if (!tableGet(&vm.lastModule->variables, name, &result)) {
-          frame->ip = ip;
-          runtimeError("Could not find variable '%s' in module '%s'", name->chars, vm.lastModule->name->chars);
+
+      INVOKE(2);
+      DISPATCH();
+    }
+    CASE_CODE(SLICE): {
+      // The ends of the range are on the stack. Anything but a list or a
+      // string runs the code that follows, which makes the Range and calls
+      // get() with it.
+      bool isInclusive = READ_BYTE();
+      uint16_t offset = READ_SHORT();
+      Value seq = vm.stackTop[-3];
+      if ((IS_LIST(seq) || IS_STRING(seq)) && IS_NUMBER(vm.stackTop[-2]) && IS_NUMBER(vm.stackTop[-1])) {
+        STORE_FRAME();
+        Value slice;
+        if (!sliceSequence(seq, AS_NUMBER(vm.stackTop[-2]), AS_NUMBER(vm.stackTop[-1]), isInclusive, &slice)) {
           return INTERPRET_RUNTIME_ERROR;
         }
 
-        push(result);
-        break;
+        vm.stackTop -= 2;
+        vm.stackTop[-1] = slice;
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE_CODE(NOT): {
+      if (IS_BOOL(vm.stackTop[-1])) {
+        vm.stackTop[-1] = BOOL_VAL(!AS_BOOL(vm.stackTop[-1]));
+        SKIP_VARIABLE();
+        SKIP_VARIABLE();
+      } else {
+        INVOKE(0);
       }
-      case OP_IMPORT_ALL_VARIABLES: {
-        ObjModule* current = frame->closure->function->module;
-        tableAddAll(&vm.lastModule->variables, &current->variables, false);
+      DISPATCH();
+    }
+    CASE_CODE(IMPORT_MODULE): {
+      ObjString* name = READ_STRING();
+      STORE_FRAME();
+      Value module = importModule(name);
+      if (IS_NONE(module)) return INTERPRET_RUNTIME_ERROR;
+      push(module);
+
+      if (IS_CLOSURE(module)) {
+        ObjClosure* closure = AS_CLOSURE(module);
+        if (!call(closure, 0)) return INTERPRET_RUNTIME_ERROR;
+        LOAD_FRAME();
+      } else {
+        vm.lastModule = AS_MODULE(module);
       }
-      case OP_END_MODULE:
-        vm.lastModule = frame->closure->function->module;
-        break;
-      case OP_TUPLE: {
-        int length = READ_BYTE();
-        ObjTuple* tuple = newTuple(length);
 
-        for (int i = length - 1; i >= 0; i--) {
-          tuple->items[i] = pop();
-        }
+      DISPATCH();
+    }
+    CASE_CODE(IMPORT_VARIABLE): {
+      ObjString* name = READ_STRING();
+      ASSERT(vm.lastModule != NULL, "Module should be imported already");
+      Value result;
+      if (!moduleGetVariable(vm.lastModule, name, &result)) {
+        STORE_FRAME();
+        runtimeError("Could not find variable '%s' in module '%s'", name->chars, vm.lastModule->name->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
 
-        push(OBJ_VAL(tuple));
-        break;
-      }
-      case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
+      push(result);
+      DISPATCH();
+    }
+    CASE_CODE(IMPORT_ALL_VARIABLES): {
+      ObjModule* current = frame->closure->function->module;
+      for (int i = 0; i < vm.lastModule->slotCount; i++) {
+        ModuleVariable* variable = &vm.lastModule->slots[i];
+        if (IS_UNDEFINED(variable->value)) continue;
+
+        // Reads of a value might already have been replaced by what it held, so
+        // it can't be changed by an import either.
+        Value slot;
+        if (tableGet(&current->variables, variable->name, &slot)) {
+          ModuleVariable* existing = &current->slots[(int)AS_NUMBER(slot)];
+          if (!existing->isMutable && !valuesEqual(existing->value, variable->value)) {
+            STORE_FRAME();
+            runtimeError("Conflicting declarations of value '%s'", variable->name->chars);
+            return INTERPRET_RUNTIME_ERROR;
           }
         }
-        break;
+        moduleDefineVariable(current, variable->name, variable->value, false);
       }
-      case OP_CLOSE_UPVALUE:
-        closeUpvalues(vm.stackTop - 1);
-        pop();
-        break;
-      case OP_RETURN: {
-        Value result = pop();
-        closeUpvalues(frame->slots);
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          pop(); // Main
-          return INTERPRET_OK;
+    }
+    CASE_CODE(END_MODULE):
+      vm.lastModule = frame->closure->function->module;
+      DISPATCH();
+    CASE_CODE(TUPLE): {
+      int length = READ_BYTE();
+
+      // A tuple that's returned to be unpacked right away is never made. The
+      // values go straight to where the caller's UNPACK would have put them,
+      // above a placeholder for the tuple.
+      if (*ip == OP_RETURN && vm.frameCount > vm.baseFrame + 1) {
+        uint8_t* callerIp = vm.frames[vm.frameCount - 2].ip;
+        if (callerIp[0] == OP_UNPACK && callerIp[1] == length) {
+          closeUpvalues(slots);
+          memmove(slots + 1, vm.stackTop - length, sizeof(Value) * length);
+          slots[0] = NONE_VAL;
+          vm.stackTop = slots + 1 + length;
+          vm.frameCount--;
+
+          LOAD_FRAME();
+          ip += 4 + ((ip[2] << 8) | ip[3]);
+          DISPATCH();
         }
+      }
 
-        vm.stackTop = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        ip = frame->ip;
-        break;
-      }
-      case OP_RETURN_OUTPUT:
-        printf("= > ");
-        printValue(peek());
-        printf("\n");
-        break;
-      case OP_CLASS: {
-        Value superclass = peek();
-        if (!IS_CLASS(superclass)) {
-          frame->ip = ip;
-          runtimeError("Superclass must be a class");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      ObjTuple* tuple = newTuple(length);
+
+      for (int i = length - 1; i >= 0; i--) {
+        tuple->items[i] = pop();
+      }
 
-        ObjClass* new = newClass(READ_STRING());
-        bindSuperclass(new, AS_CLASS(superclass));
+      push(OBJ_VAL(tuple));
+      DISPATCH();
+    }
+    CASE_CODE(UNPACK): {
+      // Tuples and lists with the right number of items are unpacked here,
+      // and anything else runs the code that follows, which calls count and
+      // get().
+      uint8_t count = READ_BYTE();
+      uint16_t offset = READ_SHORT();
+      Value value = peek();
+      Value* items = NULL;
+      if (IS_TUPLE(value) && AS_TUPLE(value)->count == count) {
+        items = AS_TUPLE(value)->items;
+      } else if (IS_LIST(value) && AS_LIST(value)->count == count) {
+        items = AS_LIST(value)->items;
+      }
 
-        push(OBJ_VAL(new));
-        break;
+      if (items != NULL) {
+        memcpy(vm.stackTop, items, sizeof(Value) * count);
+        vm.stackTop += count;
+        ip += offset;
       }
-      case OP_METHOD_INSTANCE:
-        defineMethod(AS_CLASS(peek2()), READ_STRING());
-        break;
-      case OP_METHOD_STATIC:
-        defineMethod(AS_CLASS(peek2())->obj.cls, READ_STRING());
-        break;
+      DISPATCH();
     }
+    CASE_CODE(CLOSURE): {
+      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      ObjClosure* closure = newClosure(function);
+      push(OBJ_VAL(closure));
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if (isLocal) {
+          closure->upvalues[i] = captureUpvalue(slots + index);
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+      }
+      DISPATCH();
+    }
+    CASE_CODE(CLOSE_UPVALUE):
+      closeUpvalues(vm.stackTop - 1);
+      pop();
+      DISPATCH();
+    CASE_CODE(RETURN): {
+      Value result = pop();
+      closeUpvalues(slots);
+      vm.frameCount--;
+      if (vm.frameCount == vm.baseFrame) {
+        // Either the script is done, and Main is popped along with the slots,
+        // or this was called by a native, which gets the result on the stack.
+        vm.stackTop = slots;
+        if (vm.frameCount > 0) push(result);
+        return INTERPRET_OK;
+      }
+
+      vm.stackTop = slots;
+      push(result);
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(RETURN_OUTPUT):
+      printf("= > ");
+      printValue(peek());
+      printf("\n");
+      DISPATCH();
+    CASE_CODE(CLASS): {
+      Value superclass = peek();
+      if (!IS_CLASS(superclass)) {
+        STORE_FRAME();
+        runtimeError("Superclass must be a class");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      ObjClass* new = newClass(READ_STRING());
+      bindSuperclass(new, AS_CLASS(superclass));
+
+      push(OBJ_VAL(new));
+      DISPATCH();
+    }
+    CASE_CODE(METHOD_INSTANCE):
+      defineMethod(AS_CLASS(peek2()), READ_STRING());
+      DISPATCH();
+    CASE_CODE(METHOD_STATIC):
+      defineMethod(AS_CLASS(peek2())->obj.cls, READ_STRING());
+      DISPATCH();
   }
 
+  // Every instruction dispatches to the next one, so this is never reached.
+  ASSERT(false, "Reached the end of the interpreter loop");
+  return INTERPRET_RUNTIME_ERROR;
+
+# undef LOAD_FRAME
+# undef STORE_FRAME
 # undef READ_BYTE
+# undef READ_VARIABLE
 # undef READ_CONSTANT
 # undef READ_SHORT
 # undef READ_STRING
+# undef SKIP_VARIABLE
+# undef READ_CACHE
+# undef INVOKE
+# undef BINARY_OP
+# undef TRACE_INSTRUCTION
+# undef COUNT_INSTRUCTION
+# undef INTERPRET_LOOP
+# undef CASE_CODE
+# undef DISPATCH
+# undef CACHE_STAT
+}
+
+// Lets a native call [callee] with [argCount] arguments from [args], and waits
+// for it to return [result]. Returns false after a runtime error, which the
+// native should pass on by returning false too.
+bool vmCallValue(Value callee, int argCount, Value* args, Value* result) {
+  if (vm.nestedRuns == MAX_NESTED_RUNS) {
+    runtimeError("Stack overflow");
+    return false;
+  }
+
+  int needed = argCount + 1 + STACK_RESERVE;
+  if (vm.stackTop + needed > vm.stack + vm.stackCapacity) {
+    // The arguments could be on the stack too, and move along with it.
+    bool onStack = args >= vm.stack && args < vm.stackTop;
+    ptrdiff_t offset = args - vm.stack;
+    if (!growStack(needed)) {
+      runtimeError("Stack overflow");
+      return false;
+    }
+    if (onStack) args = vm.stack + offset;
+  }
+
+  push(callee);
+  for (int i = 0; i < argCount; i++) {
+    push(args[i]);
+  }
+
+  // Natives and classes without an initializer are done once they're called.
+  // Anything that pushed a frame is run in a loop of its own, which stops
+  // when that frame returns.
+  int baseFrame = vm.baseFrame;
+  vm.baseFrame = vm.frameCount;
+  vm.nestedRuns++;
+  bool success = callValue(callee, argCount);
+  if (success && vm.frameCount > vm.baseFrame) success = run() == INTERPRET_OK;
+  vm.nestedRuns--;
+  vm.baseFrame = baseFrame;
+
+  if (!success) return false;
+  *result = pop();
+  return true;
 }
 
 InterpretResult interpret(const char* source, const char* module, bool printResult) {
@@ -835,7 +1963,7 @@ InterpretResult interpret(const char* source, const char* module, bool printResu
 
   push(OBJ_VAL(closure));
   // Initialize the main call frame
-  call(closure, 0);
+  if (!call(closure, 0)) return INTERPRET_RUNTIME_ERROR;
 
   return run();
 }
@@ -5,11 +5,21 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// How many call frames and stack slots the VM starts with. Both grow as calls
+// get deeper, until together they reach MAX_STACK_BYTES.
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL (FRAMES_INITIAL * 16)
+
+// The slots kept free above what the running function can use, for the values
+// the VM pushes just to keep them rooted, like in addConstant().
+#define STACK_RESERVE 8
 
 #define MAX_TEMP_ROOTS 8
 
+// How deep natives can call back into the VM. Each of those calls runs on the
+// C stack, so they're limited separately from the frames.
+#define MAX_NESTED_RUNS 1024
+
 typedef struct {
   ObjClosure* closure;
   uint8_t* ip;
@@ -36,15 +46,33 @@ typedef struct {
   Table modules;
   ObjModule* lastModule;
 
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frameCount;
-
-  Value stack[STACK_MAX];
+  int frameCapacity;
+  // The frames below this one belong to calls that are waiting on a native,
+  // which called back into the VM. The innermost run() returns once the
+  // frames above it have.
+  int baseFrame;
+  // How many of those calls back into the VM are running at once.
+  int nestedRuns;
+
+  Value* stack;
   Value* stackTop;
+  int stackCapacity;
   Table strings;
   ObjUpvalue* openUpvalues;
   ObjString* initString;
+  // "init()", "init(1)" and so on, indexed by arity.
+  ObjString* initSignatures[MAX_PARAMETERS + 1];
   ObjString* coreString;
+  // The shape of an instance without any fields, which all other shapes grow from.
+  ObjShape* emptyShape;
+
+  // This changes whenever a class is created or a method table is modified,
+  // which invalidates every inline cache at once.
+  uint32_t methodEpoch;
+  // Every method signature that has a symbol, indexed by that symbol.
+  ValueArray methodNames;
 
   size_t bytesAllocated;
   size_t nextGC;
@@ -55,6 +83,11 @@ typedef struct {
 
   Obj* tempRoots[MAX_TEMP_ROOTS];
   int rootCount;
+
+# if DEBUG_COUNT_OPCODE_PAIRS
+  // How many times the second instruction ran right after the first.
+  uint64_t opcodePairs[UINT8_COUNT][UINT8_COUNT];
+# endif
 } VM;
 
 typedef enum {
@@ -65,9 +98,14 @@ typedef enum {
 
 extern VM vm;
 
+static inline bool isFalsy(Value value) {
+  return IS_NONE(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
 static inline ObjClass* getClass(Value value) {
-  if (IS_NUMBER(value)) return vm.numberClass;
+  // Numbers stored as ints are Ints, which is a subclass of Number.
   if (IS_INT(value)) return vm.intClass;
+  if (IS_NUMBER(value)) return vm.numberClass;
   if (IS_OBJ(value)) return AS_OBJ(value)->cls;
 
 # if NAN_TAGGING
@@ -93,6 +131,7 @@ void runtimeError(const char* format, ...);
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source, const char* module, bool inRepl);
+bool vmCallValue(Value callee, int argCount, Value* args, Value* result);
 void push(Value value);
 Value pop();
 